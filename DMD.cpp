@@ -2,96 +2,285 @@
 
  DMD.cpp - Function and support library for the Freetronics DMD, a 512 LED matrix display
            panel arranged in a 32 x 16 layout. Port na Raspberry Pi + lgpio.
+           Hardware access goes through DMDBackend (DMDBackend.cpp).
 
 --------------------------------------------------------------------------------------*/
 #include "DMD.h"
+#include "DMDBackend.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(DMD_NO_NEON)
+#include <arm_neon.h>
+#define DMD_USE_NEON 1
+#endif
+
+static inline uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Byte with its bit order reversed, for panels mounted mirrored in x
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+static const uint8_t bBitReverse[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R2
+#undef R4
+#undef R6
+
+static void waitUntil(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
 
 /*--------------------------------------------------------------------------------------
  Setup and instantiation of DMD library
 --------------------------------------------------------------------------------------*/
-DMD::DMD(uint8_t panelsWide, uint8_t panelsHigh) {
+DMD::DMD(uint16_t panelsWide, uint16_t panelsHigh, uint8_t layout, DMDBackend *backend) {
+    init(panelsWide, panelsHigh, layout, backend, NULL);
+}
+
+DMD::DMD(uint16_t panelsWide, uint16_t panelsHigh, uint8_t layout, DMDBackend *backend, const Storage &storage) {
+    init(panelsWide, panelsHigh, layout, backend, &storage);
+}
+
+void DMD::init(uint16_t panelsWide, uint16_t panelsHigh, uint8_t layout, DMDBackend *backend, const Storage *storage) {
     DisplaysWide  = panelsWide;
     DisplaysHigh  = panelsHigh;
     DisplaysTotal = DisplaysWide * DisplaysHigh;
     row1 = DisplaysTotal << 4;
     row2 = DisplaysTotal << 5;
     row3 = ((DisplaysTotal << 2) * 3) << 2;
-    bDMDScreenRAM = (uint8_t*) malloc(DisplaysTotal * DMD_RAM_SIZE_BYTES);
+    bBitplanes = 1;
+    uiPlaneBytes = DisplaysTotal * DMD_RAM_SIZE_BYTES;
+    bStaticStorage = (storage != NULL);
+    if (storage != NULL) {
+        // Buffers for the second screen are taken over now but only used once
+        // double buffering is enabled
+        for (int b = 0; b < 2; b++) {
+            bScreenBuffers[b] = storage->screen[b];
+            bSPIBuffer[b] = storage->spiBuffer[b];
+            bStalePanels[b] = storage->stalePanels[b];
+        }
+        bDirtyPanels = storage->dirtyPanels;
+        bDirtyPublished = storage->dirtyPublished;
+        uiRowOffset = storage->rowOffset;
+        uiPackMap = storage->packMap;
+        pPanelSlots = storage->panelSlots;
+    } else {
+        bScreenBuffers[0] = (uint8_t*) malloc(uiPlaneBytes * DMD_MAX_BITPLANES);
+        bScreenBuffers[1] = NULL;
+        bSPIBuffer[0] = (uint8_t*) malloc((DisplaysTotal << 4) * 4 * DMD_MAX_BITPLANES);
+        bSPIBuffer[1] = NULL;
+        bDirtyPanels = (uint8_t*) malloc(DisplaysTotal);
+        bDirtyPublished = (uint8_t*) malloc(DisplaysTotal);
+        bStalePanels[0] = (uint8_t*) malloc(DisplaysTotal);
+        bStalePanels[1] = NULL;
+        uiRowOffset = (unsigned int*) malloc(DMD_PIXELS_DOWN * panelsHigh * sizeof(unsigned int));
+        uiPackMap = (unsigned int*) malloc(4 * row1 * sizeof(unsigned int));
+        pPanelSlots = (DMDPanelSlot*) malloc(DisplaysTotal * sizeof(DMDPanelSlot));
+    }
+    bDMDScreenRAM = bScreenBuffers[0];
+    pFrontRAM = bDMDScreenRAM;
+    pPendingRAM = NULL;
+    bDoubleBuffered = false;
+    bCopyOnFlip = true;
+    bFlipAtFrameStart = false;
+    memset(bDirtyPanels, 0, DisplaysTotal);
+    memset(bDirtyPublished, 0, DisplaysTotal);
+    bSharedMarks = false;
+    memset(bStalePanels[0], DMD_ALL_PHASES, DisplaysTotal);
+    // Dark until packed: a phase sent before it is packed must not light every LED
+    memset(bSPIBuffer[0], 0xFF, (DisplaysTotal << 4) * 4 * DMD_MAX_BITPLANES);
+    ulPhasesPacked = 0;
+    ulPhasesReused = 0;
+    Font = NULL;
+    pFontAtlas = NULL;
+    memset(fontAtlases, 0, sizeof(fontAtlases));
+    bNextAtlas = 0;
+    bFallbackFonts = 0;
+    for (int i = 0; i < DMD_MAX_MARQUEES; i++) marquees[i].active = false;
+    memset(layers, 0, sizeof(layers));
+    bLayerCount = 0;
+    bComposeRects = 0;
 
-    // init GPIO + SPI
-    hChip = lgGpiochipOpen(0);
-    if (hChip < 0) { perror("lgGpiochipOpen"); exit(1); }
+    // DMD_LAYOUT_ROWS: linia y panelu to ciągłe DisplaysTotal*4 bajtów (kolejne panele obok siebie).
+    // DMD_LAYOUT_WIRE: faza p to ciągły blok rowsize*4 bajtów; bajt kolumny i zajmuje
+    // cztery kolejne pozycje dla linii p+12, p+8, p+4, p - dokładnie tak jak idzie na SPI.
+    bLayout = layout;
+    bColShift = (layout == DMD_LAYOUT_WIRE) ? 2 : 0;
+    for (unsigned int y = 0; y < DMD_PIXELS_DOWN * DisplaysHigh; y++) {
+        unsigned int panelRow = y / DMD_PIXELS_DOWN;
+        unsigned int line = y % DMD_PIXELS_DOWN;
+        if (layout == DMD_LAYOUT_WIRE)
+            uiRowOffset[y] = (line & 3) * row1 + ((panelRow * DisplaysWide * 4) << 2) + (3 - (line >> 2));
+        else
+            uiRowOffset[y] = line * (DisplaysTotal << 2) + panelRow * DisplaysWide * 4;
+    }
+    buildPackMap(NULL);
 
-    lgGpioClaimOutput(hChip, 0, PIN_DMD_A, 0);
-    lgGpioClaimOutput(hChip, 0, PIN_DMD_B, 0);
-    lgGpioClaimOutput(hChip, 0, PIN_DMD_CLK, 0);
-    lgGpioClaimOutput(hChip, 0, PIN_DMD_SCLK, 0);
-    lgGpioClaimOutput(hChip, 0, PIN_DMD_R_DATA, 1);
-    lgGpioClaimOutput(hChip, 0, PIN_DMD_nOE, 0);
+    // init GPIO + SPI
+    bOwnsOutput = (backend == NULL);
+#ifndef DMD_NO_LGPIO
+    if (backend == NULL) backend = new DMDLgpioBackend();
+#else
+    if (backend == NULL) backend = new DMDSpidevBackend();
+#endif
+    pOutput = backend;
+    bOutputOpen = pOutput->open();
 
-    hSpi = lgSpiOpen(SPI_BUS, SPI_CHIP, SPI_SPEED, 0);
-    if (hSpi < 0) { perror("lgSpiOpen"); exit(1); }
+    bChains = 1;
+    pChainOutput[0] = pOutput;
+    uiChainFirst[0] = 0;
+    uiChainPanels[0] = DisplaysTotal;
+    iChainThreads = 0;
+    pthread_mutex_init(&chainMutex, NULL);
+    pthread_cond_init(&chainStart, NULL);
+    pthread_cond_init(&chainDone, NULL);
 
     clearScreen(true);
     bDMDByte = 0;
+    bRefreshRunning.store(false, std::memory_order_release);
+    uiRefreshRate = DMD_DEFAULT_REFRESH_HZ;
+    iRefreshPriority = 0;
+    iRefreshCpu = -1;
+    bBrightness = DMD_MAX_BRIGHTNESS;
+    fFramesPerSecond = 0;
+    uiFrameCount = 0;
+    ulFpsWindowStart = monotonicNs();
+}
+
+// Opens the output if the constructor could not; true when it is open
+bool DMD::begin() {
+    if (!bOutputOpen) bOutputOpen = pOutput->open();
+    return bOutputOpen;
 }
 
 DMD::~DMD() {
-    lgSpiClose(hSpi);
-    lgGpiochipClose(hChip);
-    free(bDMDScreenRAM);
+    stopRefresh();
+    pthread_cond_destroy(&chainDone);
+    pthread_cond_destroy(&chainStart);
+    pthread_mutex_destroy(&chainMutex);
+    if (bOwnsOutput) delete pOutput;
+    for (int i = 0; i < DMD_FONT_CACHE; i++) free(fontAtlases[i].x);
+    for (int i = 0; i < DMD_MAX_LAYERS; i++) free(layers[i].bits);
+    if (bStaticStorage) return;
+    free(uiRowOffset);
+    free(uiPackMap);
+    free(pPanelSlots);
+    for (int b = 0; b < 2; b++) {
+        free(bSPIBuffer[b]);
+        free(bStalePanels[b]);
+    }
+    free(bDirtyPanels);
+    free(bDirtyPublished);
+    free(bScreenBuffers[1]);
+    free(bScreenBuffers[0]);
 }
 
 /*--------------------------------------------------------------------------------------
  Set or clear a pixel
+
+ The graphics mode is a type (DMDOp*) chosen once per call by DMD_WITH_OP, so the
+ drawing loops below are compiled once per mode and a pixel is a load, a mask and a
+ store per bitplane.
 --------------------------------------------------------------------------------------*/
+template <class Op>
+inline void DMD::plotPixel(unsigned int bX, unsigned int bY, uint8_t bPixel) {
+    if (bX >= (DMD_PIXELS_ACROSS*DisplaysWide) || bY >= (DMD_PIXELS_DOWN * DisplaysHigh)) return;
+
+    uint8_t *pixel = bDMDScreenRAM + uiRowOffset[bY] + ((bX >> 3) << bColShift);
+    uint8_t lookup = bPixelLookupTable[bX & 0x07];
+    uint8_t *mark = bDirtyPanels + (bY >> 4) * DisplaysWide + (bX >> 5);
+
+    // In grayscale mode a plain pixel is written to every bitplane (full intensity)
+    if (bBitplanes == 1) {
+        dmdRasterOp<Op>(pixel, lookup, bPixel);
+    } else {
+        for (uint8_t plane = 0; plane < bBitplanes; plane++, pixel += uiPlaneBytes)
+            dmdRasterOp<Op>(pixel, lookup, bPixel);
+    }
+    markDirty(mark, 1 << (bY & 3));
+}
+
 void DMD::writePixel(unsigned int bX, unsigned int bY, uint8_t bGraphicsMode, uint8_t bPixel) {
-    unsigned int uiDMDRAMPointer;
+    DMD_WITH_OP(bGraphicsMode, plotPixel<Op>(bX, bY, bPixel));
+}
 
-    if (bX >= (DMD_PIXELS_ACROSS*DisplaysWide) || bY >= (DMD_PIXELS_DOWN * DisplaysHigh)) return;
+template <class Op>
+void DMD::writePixelsOp(const int *xs, const int *ys, unsigned int count, uint8_t bPixel) {
+    for (unsigned int i = 0; i < count; i++) plotPixel<Op>(xs[i], ys[i], bPixel);
+}
 
-    uint8_t panel = (bX / DMD_PIXELS_ACROSS) + (DisplaysWide * (bY / DMD_PIXELS_DOWN));
-    bX = (bX % DMD_PIXELS_ACROSS) + (panel << 5);
-    bY = bY % DMD_PIXELS_DOWN;
+void DMD::writePixels(const int *xs, const int *ys, unsigned int count, uint8_t bGraphicsMode, uint8_t bPixel) {
+    DMD_WITH_OP(bGraphicsMode, writePixelsOp<Op>(xs, ys, count, bPixel));
+}
 
-    uiDMDRAMPointer = bX/8 + bY*(DisplaysTotal<<2);
-    uint8_t lookup = bPixelLookupTable[bX & 0x07];
+/*--------------------------------------------------------------------------------------
+ Set a pixel to an intensity level (0 .. getMaxIntensity()), one bit per bitplane
+--------------------------------------------------------------------------------------*/
+void DMD::writePixelIntensity(unsigned int bX, unsigned int bY, uint8_t intensity) {
+    if (bX >= (DMD_PIXELS_ACROSS*DisplaysWide) || bY >= (DMD_PIXELS_DOWN * DisplaysHigh)) return;
 
-    switch (bGraphicsMode) {
-        case GRAPHICS_NORMAL:
-            if (bPixel) bDMDScreenRAM[uiDMDRAMPointer] &= ~lookup;
-            else bDMDScreenRAM[uiDMDRAMPointer] |= lookup;
-            break;
-        case GRAPHICS_INVERSE:
-            if (!bPixel) bDMDScreenRAM[uiDMDRAMPointer] &= ~lookup;
-            else bDMDScreenRAM[uiDMDRAMPointer] |= lookup;
-            break;
-        case GRAPHICS_TOGGLE:
-            if (bPixel) {
-                if ((bDMDScreenRAM[uiDMDRAMPointer] & lookup) == 0)
-                    bDMDScreenRAM[uiDMDRAMPointer] |= lookup;
-                else
-                    bDMDScreenRAM[uiDMDRAMPointer] &= ~lookup;
-            }
-            break;
-        case GRAPHICS_OR:
-            if (bPixel) bDMDScreenRAM[uiDMDRAMPointer] &= ~lookup;
-            break;
-        case GRAPHICS_NOR:
-            if (bPixel && ((bDMDScreenRAM[uiDMDRAMPointer] & lookup) == 0))
-                bDMDScreenRAM[uiDMDRAMPointer] |= lookup;
-            break;
+    uint8_t *pixel = bDMDScreenRAM + uiRowOffset[bY] + ((bX >> 3) << bColShift);
+    uint8_t lookup = bPixelLookupTable[bX & 0x07];
+    uint8_t *mark = bDirtyPanels + (bY >> 4) * DisplaysWide + (bX >> 5);
+    for (uint8_t plane = 0; plane < bBitplanes; plane++, pixel += uiPlaneBytes) {
+        if (intensity & (1 << plane)) *pixel &= ~lookup;
+        else *pixel |= lookup;
     }
+    markDirty(mark, 1 << (bY & 3));
 }
 
 /*--------------------------------------------------------------------------------------
  Tekst
 --------------------------------------------------------------------------------------*/
-void DMD::drawString(int bX, int bY, const char *bChars, uint8_t length, uint8_t bGraphicsMode) {
+// Decodes the UTF-8 character at text[i] and moves i past it. A byte that does not start
+// a valid sequence is taken as an ISO-8859-1 character, so Latin-1 text keeps working.
+static uint32_t utf8Next(const char *text, unsigned int length, unsigned int &i) {
+    const uint8_t *s = (const uint8_t*) text + i;
+    uint8_t b = s[0];
+    if (b < 0x80) {
+        i++;
+        return b;
+    }
+    unsigned int left = length - i;
+    if (b >= 0xC2 && b <= 0xDF && left >= 2 && (s[1] & 0xC0) == 0x80) {
+        i += 2;
+        return ((b & 0x1F) << 6) | (s[1] & 0x3F);
+    }
+    if (b >= 0xE0 && b <= 0xEF && left >= 3 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80
+        && (b != 0xE0 || s[1] >= 0xA0) && (b != 0xED || s[1] < 0xA0)) {
+        i += 3;
+        return ((b & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+    }
+    if (b >= 0xF0 && b <= 0xF4 && left >= 4 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80
+        && (s[3] & 0xC0) == 0x80 && (b != 0xF0 || s[1] >= 0x90) && (b != 0xF4 || s[1] < 0x90)) {
+        i += 4;
+        return ((b & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+    }
+    i++;
+    return b;
+}
+
+// Plain letter for U+00C0..U+017F (Latin-1 Supplement letters and Latin Extended-A),
+// used when no font has the accented glyph; 0 = none
+static const char bBaseLetter[0x180 - 0xC0 + 1] =
+    "AAAAAAACEEEEIIII" "DNOOOOOxOUUUUYPs" "aaaaaaaceeeeiiii" "dnooooo\0ouuuuypy"
+    "AaAaAaCcCcCcCcDd" "DdEeEeEeEeEeGgGg" "GgGgHhHhIiIiIiIi" "IiIiJjKkkLlLlLlL"
+    "lLlNnNnNnnNnOoOo" "OoOoRrRrRrSsSsSs" "SsTtTtTtUuUuUuUu" "UuUuWwYyYZzZzZzs";
+
+void DMD::drawString(int bX, int bY, const char *bChars, unsigned int length, uint8_t bGraphicsMode) {
     if (bX >= (DMD_PIXELS_ACROSS*DisplaysWide) || bY >= DMD_PIXELS_DOWN * DisplaysHigh) return;
     uint8_t height = *(this->Font + FONT_HEIGHT);
     if (bY+height<0) return;
@@ -99,8 +288,8 @@ void DMD::drawString(int bX, int bY, const char *bChars, uint8_t length, uint8_t
     int strWidth = 0;
     this->drawLine(bX -1 , bY, bX -1 , bY + height, GRAPHICS_INVERSE);
 
-    for (int i = 0; i < length; i++) {
-        int charWide = this->drawChar(bX+strWidth, bY, bChars[i], bGraphicsMode);
+    for (unsigned int i = 0; i < length; ) {
+        int charWide = this->drawCodePoint(bX+strWidth, bY, utf8Next(bChars, length, i), bGraphicsMode);
         if (charWide > 0) {
             strWidth += charWide ;
             this->drawLine(bX + strWidth , bY, bX + strWidth , bY + height, GRAPHICS_INVERSE);
@@ -112,94 +301,997 @@ void DMD::drawString(int bX, int bY, const char *bChars, uint8_t length, uint8_t
 
 /*--------------------------------------------------------------------------------------
  Marquee
+
+ The text is rendered once into a strip (a DMDTextLayout). A step only moves the strip
+ and redraws the rectangle: the visible window of the strip (or of its copies, with a
+ gap) is blitted and everything else in the rectangle is cleared, so any step size or
+ direction costs the same. Every region draws only inside its own rectangle, so tickers
+ and static content (a clock) can share the screen; stepMarquees() moves all regions in
+ one pass and skips those that did not move by a whole pixel.
 --------------------------------------------------------------------------------------*/
-void DMD::drawMarquee(const char *bChars, uint8_t length, int left, int top) {
-    marqueeWidth = 0;
-    for (int i = 0; i < length; i++) {
-        marqueeText[i] = bChars[i];
-        marqueeWidth += charWidth(bChars[i]) + 1;
-    }
-    marqueeHeight = *(this->Font + FONT_HEIGHT);
-    marqueeText[length] = '\0';
-    marqueeOffsetY = top;
-    marqueeOffsetX = left;
-    marqueeLength = length;
-    drawString(marqueeOffsetX, marqueeOffsetY, marqueeText, marqueeLength, GRAPHICS_NORMAL);
+// Brings offset back into [low, low + period); true if it had left it
+static bool wrapOffset(int &offset, int low, int period) {
+    if (period <= 0 || (offset >= low && offset < low + period)) return false;
+    int r = (offset - low) % period;
+    offset = low + (r < 0 ? r + period : r);
+    return true;
+}
+
+void DMD::drawMarquee(const char *bChars, unsigned int length, int left, int top) {
+    drawMarquee(bChars, length, left, top, 0, 0, DMD_PIXELS_ACROSS * DisplaysWide, DMD_PIXELS_DOWN * DisplaysHigh);
+}
+
+void DMD::drawMarquee(const char *bChars, unsigned int length, int left, int top,
+                      int x, int y, int width, int height, int gap) {
+    setMarquee(0, bChars, length, left, top, x, y, width, height, 0, 0, gap);
 }
 
 bool DMD::stepMarquee(int amountX, int amountY) {
-    bool ret=false;
-    marqueeOffsetX += amountX;
-    marqueeOffsetY += amountY;
-    if (marqueeOffsetX < -marqueeWidth) {
-        marqueeOffsetX = DMD_PIXELS_ACROSS * DisplaysWide;
-        clearScreen(true);
-        ret=true;
-    } else if (marqueeOffsetX > DMD_PIXELS_ACROSS * DisplaysWide) {
-        marqueeOffsetX = -marqueeWidth;
-        clearScreen(true);
-        ret=true;
-    }
-    if (marqueeOffsetY < -marqueeHeight) {
-        marqueeOffsetY = DMD_PIXELS_DOWN * DisplaysHigh;
-        clearScreen(true);
-        ret=true;
-    } else if (marqueeOffsetY > DMD_PIXELS_DOWN * DisplaysHigh) {
-        marqueeOffsetY = -marqueeHeight;
-        clearScreen(true);
-        ret=true;
-    }
-
-    if (amountY==0 && amountX==-1) {
-        for (int i=0; i<DMD_RAM_SIZE_BYTES*DisplaysTotal;i++) {
-            if ((i%(DisplaysWide*4)) == (DisplaysWide*4) -1)
-                bDMDScreenRAM[i]=(bDMDScreenRAM[i]<<1)+1;
-            else
-                bDMDScreenRAM[i]=(bDMDScreenRAM[i]<<1) + ((bDMDScreenRAM[i+1] & 0x80) >>7);
-        }
-        int strWidth=marqueeOffsetX;
-        for (uint8_t i=0; i < marqueeLength; i++) {
-            int wide = charWidth(marqueeText[i]);
-            if (strWidth+wide >= DisplaysWide*DMD_PIXELS_ACROSS) {
-                drawChar(strWidth, marqueeOffsetY,marqueeText[i],GRAPHICS_NORMAL);
-                return ret;
+    if (!marquees[0].active) return false;
+    return moveMarquee(marquees[0], amountX, amountY);
+}
+
+bool DMD::setMarquee(uint8_t index, const char *bChars, unsigned int length, int left, int top,
+                     int x, int y, int width, int height, int speedX, int speedY, int gap) {
+    if (index >= DMD_MAX_MARQUEES) return false;
+    DMDMarquee &m = marquees[index];
+    m.x = x;
+    m.y = y;
+    m.width = width;
+    m.height = height;
+    m.offsetX = left;
+    m.offsetY = top;
+    m.gap = gap;
+    m.speedX = speedX;
+    m.speedY = speedY;
+    m.fracX = m.fracY = 0;
+    m.active = layoutText(m.strip, 0, 0, 1 << 24, 1 << 24, bChars, length, DMD_TEXT_LEFT);
+    if (!m.active) return false;
+    // Repeated text looks the same one period further, so keep its first copy left of the rectangle
+    int period = m.strip.textWidth + gap;
+    if (gap >= 0) wrapOffset(m.offsetX, -period, period);
+    drawMarqueeWindow(m);
+    return true;
+}
+
+void DMD::setMarqueeSpeed(uint8_t index, int speedX, int speedY) {
+    if (index >= DMD_MAX_MARQUEES) return;
+    marquees[index].speedX = speedX;
+    marquees[index].speedY = speedY;
+}
+
+void DMD::removeMarquee(uint8_t index, bool clear) {
+    if (index >= DMD_MAX_MARQUEES || !marquees[index].active) return;
+    DMDMarquee &m = marquees[index];
+    m.active = false;
+    if (clear) clearRect(m.x, m.y, m.x + m.width, m.y + m.height);
+}
+
+uint32_t DMD::stepMarquees() {
+    uint32_t wrapped = 0;
+    for (int i = 0; i < DMD_MAX_MARQUEES; i++) {
+        DMDMarquee &m = marquees[i];
+        if (!m.active) continue;
+        // Whole pixels go to the offset, the rest waits for the next step (rounding toward zero)
+        m.fracX += m.speedX;
+        m.fracY += m.speedY;
+        int dx = m.fracX / DMD_MARQUEE_SUBSTEPS;
+        int dy = m.fracY / DMD_MARQUEE_SUBSTEPS;
+        m.fracX -= dx * DMD_MARQUEE_SUBSTEPS;
+        m.fracY -= dy * DMD_MARQUEE_SUBSTEPS;
+        if ((dx | dy) && moveMarquee(m, dx, dy)) wrapped |= 1u << i;
+    }
+    return wrapped;
+}
+
+bool DMD::moveMarquee(DMDMarquee &m, int amountX, int amountY) {
+    // The text with its one pixel spacing after the last character, and its lines
+    // without the spacing below the last one, as in the original ticker
+    int textWidth = m.strip.textWidth + 1;
+    int textHeight = m.strip.lines ? (m.strip.lines - 1) * (m.strip.font[FONT_HEIGHT] + 1) + m.strip.font[FONT_HEIGHT] : 0;
+    m.offsetX += amountX;
+    m.offsetY += amountY;
+    bool ret = false;
+    // Without a gap the text wraps once it has fully left the rectangle, to just outside
+    // the opposite edge: offsets stay in [-textWidth, width] and [-textHeight, height]
+    if (m.gap >= 0) ret |= wrapOffset(m.offsetX, -(m.strip.textWidth + m.gap), m.strip.textWidth + m.gap);
+    else ret |= wrapOffset(m.offsetX, -textWidth, textWidth + m.width + 1);
+    ret |= wrapOffset(m.offsetY, -textHeight, textHeight + m.height + 1);
+    drawMarqueeWindow(m);
+    return ret;
+}
+
+void DMD::drawMarqueeWindow(const DMDMarquee &m) {
+    const DMDTextLayout &strip = m.strip;
+    int right = m.x + m.width;
+    int bottom = m.y + m.height;
+    int top = m.y + m.offsetY;
+    int y1 = top > m.y ? top : m.y;
+    int y2 = top + strip.textHeight < bottom ? top + strip.textHeight : bottom;
+    if (strip.textWidth == 0 || y1 >= y2) {
+        clearRect(m.x, m.y, right, bottom);
+        return;
+    }
+    clearRect(m.x, m.y, right, y1);
+    clearRect(m.x, y2, right, bottom);
+
+    // Rows with text: the strip (every period pixels with a gap), blank in between
+    int period = m.gap >= 0 ? strip.textWidth + m.gap : 0;
+    int cursor = m.x;
+    for (int sx = m.x + m.offsetX; sx < right; sx += period) {
+        int x1 = sx > m.x ? sx : m.x;
+        int x2 = sx + strip.textWidth < right ? sx + strip.textWidth : right;
+        if (x1 < x2) {
+            clearRect(cursor, y1, x1, y2);
+            blit(x1, y1, strip.bits + (y1 - top) * strip.stride, strip.stride, x2 - x1, y2 - y1,
+                 GRAPHICS_NORMAL, x1 - sx);
+            cursor = x2;
+        }
+        if (period == 0) break;
+    }
+    clearRect(cursor, y1, right, y2);
+}
+
+/*--------------------------------------------------------------------------------------
+ Clear the screen
+--------------------------------------------------------------------------------------*/
+void DMD::clearScreen(uint8_t bNormal) {
+    if (bNormal) memset(bDMDScreenRAM,0xFF,uiPlaneBytes*bBitplanes);
+    else memset(bDMDScreenRAM,0x00,uiPlaneBytes*bBitplanes);
+    markAllDirty();
+}
+
+void DMD::markAllDirty() {
+    for (int i = 0; i < DisplaysTotal; i++) markDirty(bDirtyPanels + i, DMD_ALL_PHASES);
+}
+
+/*--------------------------------------------------------------------------------------
+ Grayscale
+
+ Each extra bitplane is a full copy of the screen layout placed after the previous
+ one. Enabling more planes copies plane 0 into them, so what is on screen keeps
+ full intensity.
+--------------------------------------------------------------------------------------*/
+void DMD::setGrayscale(uint8_t bitplanes) {
+    if (bitplanes < 1) bitplanes = 1;
+    if (bitplanes > DMD_MAX_BITPLANES) bitplanes = DMD_MAX_BITPLANES;
+    for (uint8_t plane = bBitplanes; plane < bitplanes; plane++) {
+        for (int b = 0; b < 2; b++) {
+            if (bScreenBuffers[b] != NULL)
+                memcpy(bScreenBuffers[b] + plane * uiPlaneBytes, bScreenBuffers[b], uiPlaneBytes);
+        }
+    }
+    bBitplanes = bitplanes;
+    markAllDirty();
+
+    // The planes were copied into both buffers, so both packed copies are out of date
+    for (int b = 0; b < 2; b++) {
+        if (bStalePanels[b] != NULL) memset(bStalePanels[b], DMD_ALL_PHASES, DisplaysTotal);
+    }
+}
+
+/*--------------------------------------------------------------------------------------
+ Double buffering
+
+ The scan path never takes a lock: it picks up pPendingRAM at the start of a phase
+ (or only at phase 0 when flipping at frame start, but at once while another device
+ holds the bus) and from then on reads that buffer only. swapBuffers() waits for the pick-up when the refresh thread is
+ running, so the old front buffer is never drawn into while it is being sent.
+ Without the thread nothing would pick the buffer up before drawing resumes, so the
+ flip happens at once and atFrameStart has no effect.
+--------------------------------------------------------------------------------------*/
+void DMD::enableDoubleBuffering(bool copyOnFlip) {
+    if (bDoubleBuffered) return;
+    bCopyOnFlip = copyOnFlip;
+    if (!bStaticStorage) {
+        bScreenBuffers[1] = (uint8_t*) malloc(uiPlaneBytes * DMD_MAX_BITPLANES);
+        bSPIBuffer[1] = (uint8_t*) malloc((DisplaysTotal << 4) * 4 * DMD_MAX_BITPLANES);
+        bStalePanels[1] = (uint8_t*) malloc(DisplaysTotal);
+    }
+    memcpy(bScreenBuffers[1], bDMDScreenRAM, uiPlaneBytes * bBitplanes);
+    memset(bStalePanels[1], DMD_ALL_PHASES, DisplaysTotal);
+    memset(bSPIBuffer[1], 0xFF, (DisplaysTotal << 4) * 4 * DMD_MAX_BITPLANES);
+    bDMDScreenRAM = bScreenBuffers[1];
+    bDoubleBuffered = true;
+}
+
+void DMD::swapBuffers(bool atFrameStart) {
+    if (!bDoubleBuffered) return;
+    uint8_t *oldFront = pFrontRAM.load(std::memory_order_relaxed);
+    uint8_t *newFront = bDMDScreenRAM;
+
+    bFlipAtFrameStart = atFrameStart;
+    pPendingRAM.store(newFront, std::memory_order_release);
+    while (bRefreshRunning.load(std::memory_order_acquire) && pPendingRAM.load(std::memory_order_acquire) != NULL)
+        usleep(50);
+    if (pPendingRAM.exchange(NULL, std::memory_order_acq_rel) != NULL) {
+        publishDirty(bufferIndex(newFront));
+        pFrontRAM.store(newFront, std::memory_order_release);
+    }
+
+    // The new back buffer differs from the published one only where drawing happened
+    // since the previous flip, so only those phases are copied (and repacked)
+    bDMDScreenRAM = oldFront;
+    if (bCopyOnFlip) {
+        uint8_t phases = 0;
+        for (int i = 0; i < DisplaysTotal; i++) phases |= bDirtyPublished[i];
+        markStale(bStalePanels[bufferIndex(oldFront)], bDirtyPublished);
+        copyPhases(bDMDScreenRAM, newFront, phases);
+    }
+}
+
+void DMD::copyPhases(uint8_t *dest, const uint8_t *src, uint8_t phases) {
+    int rowsize = DisplaysTotal << 2;
+    for (uint8_t plane = 0; plane < bBitplanes; plane++) {
+        unsigned int base = plane * uiPlaneBytes;
+        for (uint8_t phase = 0; phase < 4; phase++) {
+            if (!(phases & (1 << phase))) continue;
+            if (bLayout == DMD_LAYOUT_WIRE) {
+                memcpy(dest + base + phase * row1, src + base + phase * row1, row1);
+            } else {
+                for (int line = phase; line < DMD_PIXELS_DOWN; line += 4)
+                    memcpy(dest + base + line * rowsize, src + base + line * rowsize, rowsize);
             }
-            strWidth += wide+1;
-        }
-    } else if (amountY==0 && amountX==1) {
-        for (int i=(DMD_RAM_SIZE_BYTES*DisplaysTotal)-1; i>=0;i--) {
-            if ((i%(DisplaysWide*4)) == 0)
-                bDMDScreenRAM[i]=(bDMDScreenRAM[i]>>1)+128;
-            else
-                bDMDScreenRAM[i]=(bDMDScreenRAM[i]>>1) + ((bDMDScreenRAM[i-1] & 1) <<7);
-        }
-        int strWidth=marqueeOffsetX;
-        for (uint8_t i=0; i < marqueeLength; i++) {
-            int wide = charWidth(marqueeText[i]);
-            if (strWidth+wide >= 0) {
-                drawChar(strWidth, marqueeOffsetY,marqueeText[i],GRAPHICS_NORMAL);
-                return ret;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------------------
+ Panel topology
+
+ Drawing always happens in wall coordinates. Where each panel of the chain takes its
+ data from is resolved once here into uiPackMap: for every byte of a phase, in SPI
+ order, the offset of the source byte within a bitplane, flagged DMD_PACK_REVERSE
+ when the panel is mirrored in x. A panel mirrored in y shows its rows in reverse, so
+ its phase p comes from phase 3-p of the wall (recorded in pPanelSlots for the
+ dirty tracking).
+--------------------------------------------------------------------------------------*/
+bool DMD::setTopology(const DMDPanelPlacement *panels) {
+    for (int k = 0; k < DisplaysTotal; k++) {
+        if (panels[k].x >= DisplaysWide || panels[k].y >= DisplaysHigh) {
+            fprintf(stderr, "setTopology: panel %d placed outside the wall\n", k);
+            return false;
+        }
+    }
+    buildPackMap(panels);
+    return true;
+}
+
+void DMD::setSerpentineTopology() {
+    DMDPanelPlacement *panels = (DMDPanelPlacement*) malloc(DisplaysTotal * sizeof(DMDPanelPlacement));
+    for (int k = 0; k < DisplaysTotal; k++) {
+        int row = k / DisplaysWide;
+        int col = k % DisplaysWide;
+        panels[k].y = row;
+        panels[k].x = (row & 1) ? DisplaysWide - 1 - col : col;
+        panels[k].orientation = (row & 1) ? DMD_PANEL_ROTATE_180 : DMD_PANEL_NORMAL;
+    }
+    buildPackMap(panels);
+    free(panels);
+}
+
+void DMD::buildPackMap(const DMDPanelPlacement *panels) {
+    bool identity = true;
+    for (int k = 0; k < DisplaysTotal; k++) {
+        int panelX = panels ? panels[k].x : k % DisplaysWide;
+        int panelY = panels ? panels[k].y : k / DisplaysWide;
+        uint8_t orientation = panels ? panels[k].orientation : DMD_PANEL_NORMAL;
+        if (panelY * DisplaysWide + panelX != k || orientation != DMD_PANEL_NORMAL) identity = false;
+
+        pPanelSlots[k].panel = panelY * DisplaysWide + panelX;
+        pPanelSlots[k].phaseFlip = (orientation & DMD_PANEL_MIRROR_Y) != 0;
+        for (int phase = 0; phase < 4; phase++) {
+            unsigned int *map = uiPackMap + phase * row1 + k * 16;
+            for (int j = 0; j < 4; j++) {
+                int col = (orientation & DMD_PANEL_MIRROR_X) ? 3 - j : j;
+                // Rows go out bottom quarter first: p+12, p+8, p+4, p
+                for (int quarter = 3; quarter >= 0; quarter--) {
+                    int line = phase + 4 * quarter;
+                    if (orientation & DMD_PANEL_MIRROR_Y) line = DMD_PIXELS_DOWN - 1 - line;
+                    unsigned int offset = uiRowOffset[panelY * DMD_PIXELS_DOWN + line]
+                                        + ((panelX * 4 + col) << bColShift);
+                    if (orientation & DMD_PANEL_MIRROR_X) offset |= DMD_PACK_REVERSE;
+                    *map++ = offset;
+                }
             }
-            strWidth += wide+1;
+        }
+    }
+    bPackPhases = (bLayout != DMD_LAYOUT_WIRE) || !identity;
+
+    for (int b = 0; b < 2; b++) {
+        if (bStalePanels[b] != NULL) memset(bStalePanels[b], DMD_ALL_PHASES, DisplaysTotal);
+    }
+}
+
+/*--------------------------------------------------------------------------------------
+ Dirty tracking
+
+ Drawing marks the touched phases per panel in bDirtyPanels. Each screen buffer has
+ its own packed copy in bSPIBuffer and its own stale phases per chain slot (one wall
+ panel may feed several slots, mirrored in y or not), so the marks only have to
+ follow the buffer they were drawn into. They are handed over when that
+ buffer is published: by the scan path when it picks up a swapped buffer, or at scan
+ time when drawing and scanning share one buffer. In that last case the refresh thread
+ takes the marks while drawing goes on: every mark is set after the pixels it covers
+ with a release or (markDirty) and taken with an acquire exchange, so a panel whose
+ mark was taken is packed with its pixels, and a pixel written after the exchange
+ leaves its mark for the next phase.
+--------------------------------------------------------------------------------------*/
+void DMD::publishDirty(int buffer) {
+    for (int i = 0; i < DisplaysTotal; i++)
+        bDirtyPublished[i] = __atomic_exchange_n(bDirtyPanels + i, 0, __ATOMIC_ACQUIRE);
+    markStale(bStalePanels[buffer], bDirtyPublished);
+}
+
+// Marks are per wall panel and wall phase, staleness per chain slot and chain phase:
+// a slot mirrored in y sends wall phase 3-p as its phase p
+void DMD::markStale(uint8_t *stale, const uint8_t *marks) {
+    for (int k = 0; k < DisplaysTotal; k++) {
+        uint8_t m = marks[pPanelSlots[k].panel];
+        if (pPanelSlots[k].phaseFlip)
+            m = ((m & 1) << 3) | ((m & 2) << 1) | ((m & 4) >> 1) | ((m & 8) >> 3);
+        stale[k] |= m;
+    }
+}
+
+/*--------------------------------------------------------------------------------------
+ Horizontal spans
+
+ Every graphics mode reduces, for a given pixel value, to clearing (LED on), setting
+ (LED off) or toggling the covered bits, or to nothing. A span is then a masked first
+ byte, a masked last byte and whole bytes in between; in DMD_LAYOUT_ROWS those are
+ contiguous and go through memset, or eight at a time when toggling.
+--------------------------------------------------------------------------------------*/
+#define SPAN_NONE    0
+#define SPAN_CLEAR   1
+#define SPAN_SET     2
+#define SPAN_TOGGLE  3
+
+static inline uint8_t spanOp(uint8_t bGraphicsMode, uint8_t bPixel) {
+    switch (bGraphicsMode) {
+        case GRAPHICS_NORMAL:  return bPixel ? SPAN_CLEAR : SPAN_SET;
+        case GRAPHICS_INVERSE: return bPixel ? SPAN_SET : SPAN_CLEAR;
+        case GRAPHICS_TOGGLE:  return bPixel ? SPAN_TOGGLE : SPAN_NONE;
+        case GRAPHICS_OR:      return bPixel ? SPAN_CLEAR : SPAN_NONE;
+        case GRAPHICS_NOR:     return bPixel ? SPAN_SET : SPAN_NONE;
+    }
+    return SPAN_NONE;
+}
+
+static inline void spanByte(uint8_t *p, uint8_t mask, uint8_t op) {
+    if (op == SPAN_CLEAR) *p &= ~mask;
+    else if (op == SPAN_SET) *p |= mask;
+    else *p ^= mask;
+}
+
+void DMD::fillSpan(int x1, int x2, int y, uint8_t bGraphicsMode, uint8_t bPixel) {
+    int width = DMD_PIXELS_ACROSS * DisplaysWide;
+    if (y < 0 || y >= DMD_PIXELS_DOWN * DisplaysHigh) return;
+    if (x1 < 0) x1 = 0;
+    if (x2 >= width) x2 = width - 1;
+    if (x1 > x2) return;
+    uint8_t op = spanOp(bGraphicsMode, bPixel);
+    if (op == SPAN_NONE) return;
+
+    int first = x1 >> 3;
+    int last = x2 >> 3;
+    uint8_t firstMask = 0xFF >> (x1 & 7);
+    uint8_t lastMask = 0xFF << (7 - (x2 & 7));
+    int step = 1 << bColShift;
+    for (uint8_t plane = 0; plane < bBitplanes; plane++) {
+        uint8_t *p = bDMDScreenRAM + plane * uiPlaneBytes + uiRowOffset[y] + (first << bColShift);
+        if (first == last) {
+            spanByte(p, firstMask & lastMask, op);
+            continue;
+        }
+        spanByte(p, firstMask, op);
+        p += step;
+        int middle = last - first - 1;
+        if (step == 1 && op != SPAN_TOGGLE) {
+            memset(p, op == SPAN_SET ? 0xFF : 0x00, middle);
+            p += middle;
+        } else if (step == 1) {
+            for (; middle >= 8; middle -= 8, p += 8) {
+                uint64_t word;
+                memcpy(&word, p, 8);
+                word = ~word;
+                memcpy(p, &word, 8);
+            }
+            for (; middle > 0; middle--, p++) *p ^= 0xFF;
+        } else {
+            uint8_t fill = op == SPAN_SET ? 0xFF : 0x00;
+            for (; middle > 0; middle--, p += step) {
+                if (op == SPAN_TOGGLE) *p ^= 0xFF;
+                else *p = fill;
+            }
+        }
+        spanByte(p, lastMask, op);
+    }
+
+    uint8_t *dirty = bDirtyPanels + (y >> 4) * DisplaysWide;
+    for (int panel = x1 >> 5; panel <= x2 >> 5; panel++) markDirty(dirty + panel, 1 << (y & 3));
+}
+
+/*--------------------------------------------------------------------------------------
+ Bitmap blit
+
+ A destination row is handled in chunks of DMD_BLIT_CHUNK screen bytes. The source
+ bits of a chunk are first shifted in line with the screen bytes (16 bytes per step
+ with NEON, 8 with 64-bit words otherwise) and then combined with the screen by the
+ mode's blend(): whole bytes in the middle, masked bytes at both ends. In
+ DMD_LAYOUT_WIRE the bytes of a line are 4 apart, which NEON handles with vld4/vst4.
+--------------------------------------------------------------------------------------*/
+#define DMD_BLIT_CHUNK 64
+
+static inline uint64_t loadBE64(const uint8_t *p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+static inline void storeBE64(uint8_t *p, uint64_t w) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    memcpy(p, &w, 8);
+}
+
+// Source byte j of a row, zero outside the row
+static inline uint8_t blitFetch(const uint8_t *src, int bytes, int j) {
+    return (j >= 0 && j < bytes) ? src[j] : 0;
+}
+
+// out[i] = the 8 source bits starting at bit (bit + i*8) of a row of bytes; bit may be negative
+static void blitAlign(uint8_t *out, const uint8_t *src, int bytes, int bit, int n) {
+    int q = bit >> 3;
+    int r = bit & 7;
+    // From safeStart to safeEnd both src[q+i] and src[q+i+1] lie inside the row
+    int safeStart = q < 0 ? -q : 0;
+    int safeEnd = bytes - 1 - q;
+    if (safeStart > n) safeStart = n;
+    if (safeEnd > n) safeEnd = n;
+
+    int i = 0;
+    for (; i < safeStart; i++)
+        out[i] = (blitFetch(src, bytes, q + i) << r) | (blitFetch(src, bytes, q + i + 1) >> (8 - r));
+#ifdef DMD_USE_NEON
+    int8x16_t left = vdupq_n_s8(r);
+    int8x16_t right = vdupq_n_s8(r - 8);
+    for (; i + 16 <= safeEnd; i += 16) {
+        uint8x16_t a = vld1q_u8(src + q + i);
+        uint8x16_t b = vld1q_u8(src + q + i + 1);
+        vst1q_u8(out + i, vorrq_u8(vshlq_u8(a, left), vshlq_u8(b, right)));
+    }
+#endif
+    for (; i + 8 <= safeEnd; i += 8) {
+        uint64_t w = loadBE64(src + q + i);
+        storeBE64(out + i, (w << r) | (r ? src[q + i + 8] >> (8 - r) : 0));
+    }
+    for (; i < n; i++)
+        out[i] = (blitFetch(src, bytes, q + i) << r) | (blitFetch(src, bytes, q + i + 1) >> (8 - r));
+}
+
+// Combines n aligned source bytes with screen bytes step apart; the end bytes are masked
+template <class Op>
+static void blitBytes(uint8_t *p, int step, const uint8_t *s, int n, uint8_t firstMask, uint8_t lastMask) {
+    if (n == 1) {
+        *p = Op::blend(*p, *s, (uint8_t)(firstMask & lastMask));
+        return;
+    }
+    *p = Op::blend(*p, *s, firstMask);
+    p += step;
+    int i = 1;
+    if (step == 1) {
+#ifdef DMD_USE_NEON
+        uint8x16_t full = vdupq_n_u8(0xFF);
+        for (; i + 16 <= n - 1; i += 16, p += 16)
+            vst1q_u8(p, Op::blend(vld1q_u8(p), vld1q_u8(s + i), full));
+#endif
+        for (; i + 8 <= n - 1; i += 8, p += 8) {
+            uint64_t d, w;
+            memcpy(&d, p, 8);
+            memcpy(&w, s + i, 8);
+            d = Op::blend(d, w, ~(uint64_t)0);
+            memcpy(p, &d, 8);
         }
     } else {
-        drawString(marqueeOffsetX, marqueeOffsetY, marqueeText, marqueeLength, GRAPHICS_NORMAL);
+#ifdef DMD_USE_NEON
+        uint8x16_t full = vdupq_n_u8(0xFF);
+        for (; step == 4 && i + 16 <= n - 1; i += 16, p += 64) {
+            uint8x16x4_t d = vld4q_u8(p);
+            d.val[0] = Op::blend(d.val[0], vld1q_u8(s + i), full);
+            vst4q_u8(p, d);
+        }
+#endif
+    }
+    for (; i < n - 1; i++, p += step) *p = Op::blend(*p, s[i], (uint8_t)0xFF);
+    *p = Op::blend(*p, s[n - 1], lastMask);
+}
+
+void DMD::blit(int x, int y, const uint8_t *bitmap, unsigned int stride, int width, int height,
+               uint8_t bGraphicsMode, int srcX) {
+    DMD_WITH_OP(bGraphicsMode, blitOp<Op>(x, y, bitmap, stride, width, height, srcX));
+}
+
+template <class Op>
+void DMD::blitOp(int x, int y, const uint8_t *bitmap, unsigned int stride, int width, int height, int srcX) {
+    int x1 = x < 0 ? 0 : x;
+    int x2 = x + width - 1;
+    if (x2 >= DMD_PIXELS_ACROSS * DisplaysWide) x2 = DMD_PIXELS_ACROSS * DisplaysWide - 1;
+    int y1 = y < 0 ? 0 : y;
+    int y2 = y + height - 1;
+    if (y2 >= DMD_PIXELS_DOWN * DisplaysHigh) y2 = DMD_PIXELS_DOWN * DisplaysHigh - 1;
+    if (x1 > x2 || y1 > y2) return;
+
+    int srcBytes = (srcX + width + 7) >> 3;
+    int first = x1 >> 3;
+    int n = (x2 >> 3) - first + 1;
+    int bit = srcX + first * 8 - x;           // source bit under the first screen bit
+    uint8_t firstMask = 0xFF >> (x1 & 7);
+    uint8_t lastMask = 0xFF << (7 - (x2 & 7));
+    int step = 1 << bColShift;
+    uint8_t aligned[DMD_BLIT_CHUNK];
+
+    for (int row = y1; row <= y2; row++) {
+        const uint8_t *src = bitmap + (row - y) * stride;
+        for (int c = 0; c < n; c += DMD_BLIT_CHUNK) {
+            int count = n - c < DMD_BLIT_CHUNK ? n - c : DMD_BLIT_CHUNK;
+            blitAlign(aligned, src, srcBytes, bit + c * 8, count);
+            uint8_t *p = bDMDScreenRAM + uiRowOffset[row] + ((first + c) << bColShift);
+            for (uint8_t plane = 0; plane < bBitplanes; plane++, p += uiPlaneBytes)
+                blitBytes<Op>(p, step, aligned, count, c == 0 ? firstMask : 0xFF,
+                              c + count == n ? lastMask : 0xFF);
+        }
+        uint8_t *dirty = bDirtyPanels + (row >> 4) * DisplaysWide;
+        for (int panel = x1 >> 5; panel <= x2 >> 5; panel++) markDirty(dirty + panel, 1 << (row & 3));
     }
-    return ret;
 }
 
 /*--------------------------------------------------------------------------------------
- Clear the screen
+ Text layout
+
+ layoutText() breaks the text into lines, aligns them and renders the whole block once
+ into a 1bpp bitmap from the font atlas; it also clips the block to the box. Drawing an
+ unchanged layout is then a single blit of the visible part.
 --------------------------------------------------------------------------------------*/
-void DMD::clearScreen(uint8_t bNormal) {
-    if (bNormal) memset(bDMDScreenRAM,0xFF,DMD_RAM_SIZE_BYTES*DisplaysTotal);
-    else memset(bDMDScreenRAM,0x00,DMD_RAM_SIZE_BYTES*DisplaysTotal);
+DMDTextLayout::DMDTextLayout() {
+    lines = 0;
+    textWidth = 0;
+    textHeight = 0;
+    bits = NULL;
+    stride = 0;
+    bitsCapacity = 0;
+    clipX = clipY = clipWidth = clipHeight = 0;
+    srcX = srcY = 0;
+    font = NULL;
+    text = NULL;
+    textLength = 0;
+    textCapacity = 0;
+    boxX = boxY = boxWidth = boxHeight = 0;
+    flags = 0;
+}
+
+DMDTextLayout::~DMDTextLayout() {
+    free(bits);
+    free(text);
+}
+
+// ORs width bits of a source row, starting at bit srcX, into a bitmap row at bit dstX
+static void orBits(uint8_t *dst, int dstX, const uint8_t *src, int srcBytes, int srcX, int width) {
+    uint8_t aligned[DMD_BLIT_CHUNK];
+    int first = dstX >> 3;
+    int last = (dstX + width - 1) >> 3;
+    for (int c = first; c <= last; c += DMD_BLIT_CHUNK) {
+        int n = last - c + 1 < DMD_BLIT_CHUNK ? last - c + 1 : DMD_BLIT_CHUNK;
+        blitAlign(aligned, src, srcBytes, srcX + (c - first) * 8 - (dstX & 7), n);
+        for (int i = 0; i < n; i++) {
+            uint8_t mask = 0xFF;
+            if (c + i == first) mask &= 0xFF >> (dstX & 7);
+            if (c + i == last) mask &= 0xFF << (7 - ((dstX + width - 1) & 7));
+            dst[c + i] |= aligned[i] & mask;
+        }
+    }
+}
+
+// Finds the line starting at start: up to '\n', the end of the text or, with wrapping,
+// the last space before the first character that does not fit. Returns the end of the
+// line and sets next to the start of the following one (length + 1 after the last).
+// Leading spaces that would leave the line empty are dropped (start moves past them).
+unsigned int DMD::textLineEnd(const char *text, unsigned int length, unsigned int &start, int width, bool wrap,
+                              unsigned int &next) {
+    unsigned int lastSpace = length;
+    int lineWidth = 0;
+    next = length + 1;
+    for (unsigned int j = start; j < length; ) {
+        unsigned int at = j;
+        uint32_t c = utf8Next(text, length, j);
+        if (c == '\n') {
+            next = j;
+            return at;
+        }
+        int charWide = codePointWidth(c);
+        if (charWide == 0) continue;
+        int wide = lineWidth ? lineWidth + 1 + charWide : charWide;
+        if (wrap && wide > width && lineWidth > 0) {
+            unsigned int end = (c != ' ' && lastSpace < at) ? lastSpace : at;
+            while (end > start && text[end - 1] == ' ') end--;
+            if (end == start) {
+                // Only leading spaces before the break: drop them and measure the line again
+                while (start < length && text[start] == ' ') start++;
+                j = start;
+                lineWidth = 0;
+                lastSpace = length;
+                continue;
+            }
+            // The spaces at the break belong to neither line, and so does a '\n' right
+            // after them. Only that '\n' can start a following line at the end of the text.
+            next = end;
+            while (next < length && text[next] == ' ') next++;
+            if (next < length && text[next] == '\n') next++;
+            else if (next == length) next = length + 1;
+            return end;
+        }
+        if (c == ' ') lastSpace = at;
+        lineWidth = wide;
+    }
+    return length;
+}
+
+bool DMD::layoutText(DMDTextLayout &layout, int x, int y, int width, int height,
+                     const char *text, unsigned int length, uint8_t flags) {
+    layout.font = NULL;
+    layout.lines = 0;
+    layout.textWidth = 0;
+    layout.textHeight = 0;
+    layout.clipWidth = layout.clipHeight = 0;
+    DMDFontAtlas *a = pFontAtlas;
+    if (a == NULL) return false;
+
+    // Remember the input so drawText() can tell an unchanged layout
+    if (length > layout.textCapacity) {
+        char *copy = (char*) realloc(layout.text, length);
+        if (copy == NULL) {
+            perror("DMD text layout");
+            return false;
+        }
+        layout.text = copy;
+        layout.textCapacity = length;
+    }
+    if (length > 0) memcpy(layout.text, text, length);
+    layout.textLength = length;
+    layout.boxX = x;
+    layout.boxY = y;
+    layout.boxWidth = width;
+    layout.boxHeight = height;
+    layout.flags = flags;
+
+    // First pass: number of lines and the widest one
+    bool wrap = (flags & DMD_TEXT_WRAP) != 0;
+    unsigned int next = 0;
+    while (length > 0 && next <= length) {
+        unsigned int start = next;
+        unsigned int end = textLineEnd(text, length, start, width, wrap, next);
+        int lineWidth = stringWidth(text + start, end - start);
+        if (lineWidth > layout.textWidth) layout.textWidth = lineWidth;
+        layout.lines++;
+    }
+    int pitch = this->Font[FONT_HEIGHT] + 1;
+    layout.textHeight = layout.lines ? (layout.lines - 1) * pitch + a->rows : 0;
+    layout.font = this->Font;
+    if (layout.textWidth == 0) return true;
+
+    layout.stride = (layout.textWidth + 7) / 8;
+    unsigned int bytes = layout.stride * layout.textHeight;
+    if (bytes > layout.bitsCapacity) {
+        uint8_t *bits = (uint8_t*) realloc(layout.bits, bytes);
+        if (bits == NULL) {
+            perror("DMD text layout");
+            layout.font = NULL;
+            return false;
+        }
+        layout.bits = bits;
+        layout.bitsCapacity = bytes;
+    }
+    memset(layout.bits, 0, bytes);
+
+    // Second pass: glyphs into the block, each line aligned within the widest one
+    next = 0;
+    for (unsigned int line = 0; line < layout.lines; line++) {
+        unsigned int start = next;
+        unsigned int end = textLineEnd(text, length, start, width, wrap, next);
+        int lineWidth = stringWidth(text + start, end - start);
+        int cursor = 0;
+        if ((flags & 0x03) == DMD_TEXT_CENTER) cursor = (layout.textWidth - lineWidth) / 2;
+        else if ((flags & 0x03) == DMD_TEXT_RIGHT) cursor = layout.textWidth - lineWidth;
+        uint8_t *row = layout.bits + line * pitch * layout.stride;
+        bool first = true;
+        for (unsigned int i = start; i < end; ) {
+            uint32_t c = utf8Next(text, end, i);
+            int charWide = codePointWidth(c);
+            if (charWide == 0) continue;
+            if (!first) cursor++;
+            first = false;
+            DMDFontAtlas *g;
+            unsigned int glyph;
+            if (c != ' ' && findGlyph(c, g, glyph)) {
+                // A glyph from a fallback font gets the rows of the current one
+                int rows = g->rows < a->rows ? g->rows : a->rows;
+                for (int r = 0; r < rows; r++)
+                    orBits(row + r * layout.stride, cursor, g->bits + r * g->stride, g->stride, g->x[glyph], charWide);
+            }
+            cursor += charWide;
+        }
+    }
+
+    // Place the block in the box and clip it
+    int blockX = x, blockY = y;
+    if ((flags & 0x03) == DMD_TEXT_CENTER) blockX += (width - layout.textWidth) / 2;
+    else if ((flags & 0x03) == DMD_TEXT_RIGHT) blockX += width - layout.textWidth;
+    if ((flags & 0x0C) == DMD_TEXT_MIDDLE) blockY += (height - layout.textHeight) / 2;
+    else if ((flags & 0x0C) == DMD_TEXT_BOTTOM) blockY += height - layout.textHeight;
+    int x1 = blockX > x ? blockX : x;
+    int y1 = blockY > y ? blockY : y;
+    int x2 = blockX + layout.textWidth < x + width ? blockX + layout.textWidth : x + width;
+    int y2 = blockY + layout.textHeight < y + height ? blockY + layout.textHeight : y + height;
+    if (x1 < x2 && y1 < y2) {
+        layout.clipX = x1;
+        layout.clipY = y1;
+        layout.clipWidth = x2 - x1;
+        layout.clipHeight = y2 - y1;
+        layout.srcX = x1 - blockX;
+        layout.srcY = y1 - blockY;
+    }
+    return true;
+}
+
+void DMD::drawLayout(const DMDTextLayout &layout, uint8_t bGraphicsMode) {
+    if (layout.font == NULL || layout.clipWidth <= 0 || layout.clipHeight <= 0) return;
+    blit(layout.clipX, layout.clipY, layout.bits + layout.srcY * layout.stride, layout.stride,
+         layout.clipWidth, layout.clipHeight, bGraphicsMode, layout.srcX);
+}
+
+void DMD::drawText(DMDTextLayout &layout, int x, int y, int width, int height,
+                   const char *text, unsigned int length, uint8_t flags, uint8_t bGraphicsMode) {
+    if (layout.font != this->Font || layout.textLength != length || layout.flags != flags
+        || layout.boxX != x || layout.boxY != y || layout.boxWidth != width || layout.boxHeight != height
+        || (length > 0 && memcmp(layout.text, text, length) != 0)) {
+        if (!layoutText(layout, x, y, width, height, text, length, flags)) return;
+    }
+    drawLayout(layout, bGraphicsMode);
+}
+
+/*--------------------------------------------------------------------------------------
+ Layers
+
+ A layer is a 1bpp bitmap in blit format. Changes to layers only record the screen
+ rectangles they affect; compose() rebuilds each of them row by row in chunks of
+ DMD_BLIT_CHUNK screen bytes: the chunk starts blank (0xFF), every visible layer in z
+ order is shifted in line with it by blitAlign() and combined with its mode's blend()
+ a word at a time, and the chunk is then copied into every bitplane. Recomposing a
+ rectangle does not depend on what the screen held, so overlapping rectangles are fine.
+--------------------------------------------------------------------------------------*/
+// Layers keep 1 = lit like blit() sources while the screen keeps 0 = lit, so drawing
+// into a layer is the screen mode with lit and unlit swapped
+static const uint8_t layerModes[] = { GRAPHICS_INVERSE, GRAPHICS_NORMAL, GRAPHICS_TOGGLE, GRAPHICS_NOR, GRAPHICS_OR };
+
+bool DMD::setLayer(uint8_t index, int width, int height, uint8_t bGraphicsMode, int z) {
+    if (index >= DMD_MAX_LAYERS || width <= 0 || height <= 0) return false;
+    removeLayer(index);
+    DMDLayer &layer = layers[index];
+    layer.stride = (width + 7) >> 3;
+    layer.bits = (uint8_t*)calloc(layer.stride * height, 1);
+    if (layer.bits == NULL) {
+        perror("DMD layer");
+        return false;
+    }
+    layer.width = width;
+    layer.height = height;
+    layer.x = layer.y = 0;
+    layer.z = z;
+    layer.mode = bGraphicsMode;
+    layer.visible = true;
+    sortLayers();
+    markLayer(layer);
+    return true;
+}
+
+void DMD::removeLayer(uint8_t index) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL) return;
+    markLayer(layers[index]);
+    free(layers[index].bits);
+    layers[index].bits = NULL;
+    sortLayers();
+}
+
+void DMD::moveLayer(uint8_t index, int x, int y) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL) return;
+    DMDLayer &layer = layers[index];
+    if (layer.x == x && layer.y == y) return;
+    markLayer(layer);
+    layer.x = x;
+    layer.y = y;
+    markLayer(layer);
+}
+
+void DMD::showLayer(uint8_t index, bool visible) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL || layers[index].visible == visible) return;
+    DMDLayer &layer = layers[index];
+    layer.visible = visible;
+    markRect(layer.x, layer.y, layer.x + layer.width, layer.y + layer.height);
+}
+
+void DMD::setLayerMode(uint8_t index, uint8_t bGraphicsMode) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL || layers[index].mode == bGraphicsMode) return;
+    layers[index].mode = bGraphicsMode;
+    markLayer(layers[index]);
+}
+
+void DMD::setLayerZ(uint8_t index, int z) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL || layers[index].z == z) return;
+    layers[index].z = z;
+    sortLayers();
+    markLayer(layers[index]);
+}
+
+void DMD::layerBlit(uint8_t index, int x, int y, const uint8_t *bitmap, unsigned int stride, int width, int height,
+                    uint8_t bGraphicsMode, int srcX) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL || bGraphicsMode > GRAPHICS_NOR) return;
+    DMDLayer &layer = layers[index];
+    int x1 = x < 0 ? 0 : x;
+    int x2 = x + width < layer.width ? x + width : layer.width;
+    int y1 = y < 0 ? 0 : y;
+    int y2 = y + height < layer.height ? y + height : layer.height;
+    if (x1 >= x2 || y1 >= y2) return;
+
+    int srcBytes = (srcX + width + 7) >> 3;
+    int first = x1 >> 3;
+    int n = ((x2 - 1) >> 3) - first + 1;
+    int bit = srcX + first * 8 - x;
+    uint8_t firstMask = 0xFF >> (x1 & 7);
+    uint8_t lastMask = 0xFF << (7 - ((x2 - 1) & 7));
+    uint8_t aligned[DMD_BLIT_CHUNK];
+
+    for (int row = y1; row < y2; row++) {
+        const uint8_t *src = bitmap + (row - y) * stride;
+        uint8_t *dst = layer.bits + row * layer.stride + first;
+        for (int c = 0; c < n; c += DMD_BLIT_CHUNK) {
+            int count = n - c < DMD_BLIT_CHUNK ? n - c : DMD_BLIT_CHUNK;
+            blitAlign(aligned, src, srcBytes, bit + c * 8, count);
+            DMD_WITH_OP(layerModes[bGraphicsMode],
+                        blitBytes<Op>(dst + c, 1, aligned, count, c == 0 ? firstMask : 0xFF,
+                                      c + count == n ? lastMask : 0xFF));
+        }
+    }
+    if (layer.visible) markRect(layer.x + x1, layer.y + y1, layer.x + x2, layer.y + y2);
+}
+
+void DMD::layerDrawLayout(uint8_t index, const DMDTextLayout &layout, uint8_t bGraphicsMode) {
+    if (layout.font == NULL || layout.clipWidth <= 0 || layout.clipHeight <= 0) return;
+    layerBlit(index, layout.clipX, layout.clipY, layout.bits + layout.srcY * layout.stride, layout.stride,
+              layout.clipWidth, layout.clipHeight, bGraphicsMode, layout.srcX);
+}
+
+void DMD::clearLayer(uint8_t index) {
+    if (index >= DMD_MAX_LAYERS || layers[index].bits == NULL) return;
+    memset(layers[index].bits, 0, layers[index].stride * layers[index].height);
+    markLayer(layers[index]);
+}
+
+// bLayerOrder = used layers by (z, index); a handful of entries, so insertion sort
+void DMD::sortLayers() {
+    bLayerCount = 0;
+    for (uint8_t i = 0; i < DMD_MAX_LAYERS; i++) {
+        if (layers[i].bits == NULL) continue;
+        int j = bLayerCount++;
+        for (; j > 0 && layers[bLayerOrder[j - 1]].z > layers[i].z; j--) bLayerOrder[j] = bLayerOrder[j - 1];
+        bLayerOrder[j] = i;
+    }
+}
+
+void DMD::markLayer(const DMDLayer &layer) {
+    if (layer.visible) markRect(layer.x, layer.y, layer.x + layer.width, layer.y + layer.height);
+}
+
+// Adds a rectangle to recompose. It joins an entry when their bounding box is no larger
+// than the two apart (a sprite moved by a few pixels), and when the list is full it is
+// merged into the entry whose bounding box grows least.
+void DMD::markRect(int x1, int y1, int x2, int y2) {
+    int screenWidth = DMD_PIXELS_ACROSS * DisplaysWide;
+    int screenHeight = DMD_PIXELS_DOWN * DisplaysHigh;
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > screenWidth) x2 = screenWidth;
+    if (y2 > screenHeight) y2 = screenHeight;
+    if (x1 >= x2 || y1 >= y2) return;
+
+    long area = (long)(x2 - x1) * (y2 - y1);
+    int best = -1;
+    long bestGrowth = 0;
+    for (int i = 0; i < bComposeRects; i++) {
+        const DMDRect &r = composeRects[i];
+        long w = (x2 > r.x2 ? x2 : r.x2) - (x1 < r.x1 ? x1 : r.x1);
+        long h = (y2 > r.y2 ? y2 : r.y2) - (y1 < r.y1 ? y1 : r.y1);
+        long growth = w * h - (long)(r.x2 - r.x1) * (r.y2 - r.y1);
+        if (best < 0 || growth < bestGrowth) {
+            best = i;
+            bestGrowth = growth;
+        }
+        if (growth <= area) break;
+    }
+    if ((best < 0 || bestGrowth > area) && bComposeRects < DMD_MAX_DIRTY_RECTS) {
+        DMDRect &r = composeRects[bComposeRects++];
+        r.x1 = x1;
+        r.y1 = y1;
+        r.x2 = x2;
+        r.y2 = y2;
+        return;
+    }
+    DMDRect &r = composeRects[best];
+    if (x1 < r.x1) r.x1 = x1;
+    if (y1 < r.y1) r.y1 = y1;
+    if (x2 > r.x2) r.x2 = x2;
+    if (y2 > r.y2) r.y2 = y2;
+}
+
+void DMD::compose() {
+    for (int i = 0; i < bComposeRects; i++) composeRect(composeRects[i]);
+    bComposeRects = 0;
+}
+
+void DMD::composeRect(const DMDRect &rect) {
+    int first = rect.x1 >> 3;
+    int n = ((rect.x2 - 1) >> 3) - first + 1;
+    uint8_t firstMask = 0xFF >> (rect.x1 & 7);
+    uint8_t lastMask = 0xFF << (7 - ((rect.x2 - 1) & 7));
+    int step = 1 << bColShift;
+    uint8_t chunk[DMD_BLIT_CHUNK];
+    uint8_t aligned[DMD_BLIT_CHUNK];
+
+    for (int row = rect.y1; row < rect.y2; row++) {
+        for (int c = 0; c < n; c += DMD_BLIT_CHUNK) {
+            int count = n - c < DMD_BLIT_CHUNK ? n - c : DMD_BLIT_CHUNK;
+            int left = (first + c) * 8;
+            memset(chunk, 0xFF, count);
+            for (int i = 0; i < bLayerCount; i++) {
+                const DMDLayer &layer = layers[bLayerOrder[i]];
+                if (!layer.visible || row < layer.y || row >= layer.y + layer.height) continue;
+                int x1 = layer.x > left ? layer.x : left;
+                int x2 = layer.x + layer.width < left + count * 8 ? layer.x + layer.width : left + count * 8;
+                if (x1 >= x2) continue;
+                int b = (x1 - left) >> 3;
+                int bytes = ((x2 - 1 - left) >> 3) - b + 1;
+                blitAlign(aligned, layer.bits + (row - layer.y) * layer.stride, layer.stride,
+                          left + b * 8 - layer.x, bytes);
+                DMD_WITH_OP(layer.mode, blitBytes<Op>(chunk + b, 1, aligned, bytes, 0xFF >> (x1 & 7),
+                                                      0xFF << (7 - ((x2 - 1) & 7))));
+            }
+            uint8_t *p = bDMDScreenRAM + uiRowOffset[row] + ((first + c) << bColShift);
+            for (uint8_t plane = 0; plane < bBitplanes; plane++, p += uiPlaneBytes)
+                blitBytes<DMDOpInverse>(p, step, chunk, count, c == 0 ? firstMask : 0xFF,
+                                        c + count == n ? lastMask : 0xFF);
+        }
+        uint8_t *dirty = bDirtyPanels + (row >> 4) * DisplaysWide;
+        for (int panel = rect.x1 >> 5; panel <= (rect.x2 - 1) >> 5; panel++) markDirty(dirty + panel, 1 << (row & 3));
+    }
 }
 
 /*--------------------------------------------------------------------------------------
  Draw a line
 --------------------------------------------------------------------------------------*/
 void DMD::drawLine(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode) {
+    if (y1 == y2) {
+        if (x1 <= x2) fillSpan(x1, x2, y1, bGraphicsMode, true);
+        else fillSpan(x2, x1, y1, bGraphicsMode, true);
+        return;
+    }
+    DMD_WITH_OP(bGraphicsMode, drawLineOp<Op>(x1, y1, x2, y2));
+}
+
+template <class Op>
+void DMD::drawLineOp(int x1, int y1, int x2, int y2) {
     int dy = y2 - y1;
     int dx = x2 - x1;
     int stepx, stepy;
@@ -208,20 +1300,20 @@ void DMD::drawLine(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode) {
     if (dx < 0) { dx = -dx; stepx = -1; } else { stepx = 1; }
     dy <<= 1; dx <<= 1;
 
-    writePixel(x1, y1, bGraphicsMode, true);
+    plotPixel<Op>(x1, y1, true);
     if (dx > dy) {
         int fraction = dy - (dx >> 1);
         while (x1 != x2) {
             if (fraction >= 0) { y1 += stepy; fraction -= dx; }
             x1 += stepx; fraction += dy;
-            writePixel(x1, y1, bGraphicsMode, true);
+            plotPixel<Op>(x1, y1, true);
         }
     } else {
         int fraction = dx - (dy >> 1);
         while (y1 != y2) {
             if (fraction >= 0) { x1 += stepx; fraction -= dy; }
             y1 += stepy; fraction += dx;
-            writePixel(x1, y1, bGraphicsMode, true);
+            plotPixel<Op>(x1, y1, true);
         }
     }
 }
@@ -230,38 +1322,44 @@ void DMD::drawLine(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode) {
  Circle
 --------------------------------------------------------------------------------------*/
 void DMD::drawCircle(int xCenter, int yCenter, int radius, uint8_t bGraphicsMode) {
+    DMD_WITH_OP(bGraphicsMode, drawCircleOp<Op>(xCenter, yCenter, radius));
+}
+
+template <class Op>
+void DMD::drawCircleOp(int xCenter, int yCenter, int radius) {
     int x = 0;
     int y = radius;
     int p = (5 - radius * 4) / 4;
-    drawCircleSub(xCenter, yCenter, x, y, bGraphicsMode);
+    drawCircleSub<Op>(xCenter, yCenter, x, y);
     while (x < y) {
         x++;
         if (p < 0) { p += 2 * x + 1; }
         else { y--; p += 2 * (x - y) + 1; }
-        drawCircleSub(xCenter, yCenter, x, y, bGraphicsMode);
+        drawCircleSub<Op>(xCenter, yCenter, x, y);
     }
 }
 
-void DMD::drawCircleSub(int cx, int cy, int x, int y, uint8_t bGraphicsMode) {
+template <class Op>
+void DMD::drawCircleSub(int cx, int cy, int x, int y) {
     if (x == 0) {
-        writePixel(cx, cy + y, bGraphicsMode, true);
-        writePixel(cx, cy - y, bGraphicsMode, true);
-        writePixel(cx + y, cy, bGraphicsMode, true);
-        writePixel(cx - y, cy, bGraphicsMode, true);
+        plotPixel<Op>(cx, cy + y, true);
+        plotPixel<Op>(cx, cy - y, true);
+        plotPixel<Op>(cx + y, cy, true);
+        plotPixel<Op>(cx - y, cy, true);
     } else if (x == y) {
-        writePixel(cx + x, cy + y, bGraphicsMode, true);
-        writePixel(cx - x, cy + y, bGraphicsMode, true);
-        writePixel(cx + x, cy - y, bGraphicsMode, true);
-        writePixel(cx - x, cy - y, bGraphicsMode, true);
+        plotPixel<Op>(cx + x, cy + y, true);
+        plotPixel<Op>(cx - x, cy + y, true);
+        plotPixel<Op>(cx + x, cy - y, true);
+        plotPixel<Op>(cx - x, cy - y, true);
     } else if (x < y) {
-        writePixel(cx + x, cy + y, bGraphicsMode, true);
-        writePixel(cx - x, cy + y, bGraphicsMode, true);
-        writePixel(cx + x, cy - y, bGraphicsMode, true);
-        writePixel(cx - x, cy - y, bGraphicsMode, true);
-        writePixel(cx + y, cy + x, bGraphicsMode, true);
-        writePixel(cx - y, cy + x, bGraphicsMode, true);
-        writePixel(cx + y, cy - x, bGraphicsMode, true);
-        writePixel(cx - y, cy - x, bGraphicsMode, true);
+        plotPixel<Op>(cx + x, cy + y, true);
+        plotPixel<Op>(cx - x, cy + y, true);
+        plotPixel<Op>(cx + x, cy - y, true);
+        plotPixel<Op>(cx - x, cy - y, true);
+        plotPixel<Op>(cx + y, cy + x, true);
+        plotPixel<Op>(cx - y, cy + x, true);
+        plotPixel<Op>(cx + y, cy - x, true);
+        plotPixel<Op>(cx - y, cy - x, true);
     }
 }
 
@@ -276,7 +1374,14 @@ void DMD::drawBox(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode) {
 }
 
 void DMD::drawFilledBox(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode) {
-    for (int b = x1; b <= x2; b++) drawLine(b, y1, b, y2, bGraphicsMode);
+    if (y1 > y2) { int t = y1; y1 = y2; y2 = t; }
+    for (int y = y1; y <= y2; y++) fillSpan(x1, x2, y, bGraphicsMode, true);
+}
+
+void DMD::clearRect(int x1, int y1, int x2, int y2) {
+    if (y1 < 0) y1 = 0;
+    if (y2 > DMD_PIXELS_DOWN * DisplaysHigh) y2 = DMD_PIXELS_DOWN * DisplaysHigh;
+    for (int y = y1; y < y2; y++) fillSpan(x1, x2 - 1, y, GRAPHICS_NORMAL, false);
 }
 
 /*--------------------------------------------------------------------------------------
@@ -306,57 +1411,530 @@ void DMD::drawTestPattern(uint8_t bPattern) {
 
 /*--------------------------------------------------------------------------------------
  Scan display by SPI
+
+ The whole phase is gathered into bSPIBuffer and sent with a single transfer (the
+ backend splits it only when it exceeds the spidev buffer, DMD_SPI_MAX_TRANSFER). With DMD_LAYOUT_WIRE
+ the phase already sits in the screen RAM in wire order and is sent from there.
+ bSPIBuffer keeps every packed phase of each screen buffer, and only panels marked
+ stale are gathered again.
+
+ In grayscale mode every bitplane of the phase is shown in turn for a time weighted
+ 1:2:4:8 (binary code modulation). Planes go out most significant first, so each
+ transfer overlaps the longer window of the plane before it; the last window is
+ closed by switching nOE off.
+
+ Brightness below DMD_MAX_BRIGHTNESS shortens the time nOE stays on within the phase
+ (and scales all bitplane windows), so dimming costs no extra SPI transfers.
+
+ A wall split into chains has one packed phase; each chain sends its own slice of it
+ (16 bytes per panel) through its own backend.
 --------------------------------------------------------------------------------------*/
 void DMD::scanDisplayBySPI() {
-    if (lgGpioRead(hChip, PIN_OTHER_SPI_nCS) == 1) {
-        int rowsize=DisplaysTotal<<2;
-        int offset=rowsize * bDMDByte;
-        for (int i=0;i<rowsize;i++) {
-            uint8_t bytes[4] = {
-                bDMDScreenRAM[offset+i+row3],
-                bDMDScreenRAM[offset+i+row2],
-                bDMDScreenRAM[offset+i+row1],
-                bDMDScreenRAM[offset+i]
-            };
-            lgSpiWrite(hSpi, (char*)bytes, 4);
+    const uint8_t *screen = beginPhase();
+    if (screen == NULL) return;
+    for (int chain = 0; chain < bChains; chain++) outputPhase(chain, screen);
+    endPhase();
+}
+
+// Picks up a swapped buffer and packs the current phase for all chains; NULL when
+// the bus is taken by another device and the phase has to be skipped. A skipped phase
+// still picks up the swapped buffer (at once, the phase does not advance), so
+// swapBuffers() never waits for the bus.
+const uint8_t* DMD::beginPhase() {
+    if (!bOutputOpen) return NULL;
+    bool available = pChainOutput[0]->spiAvailable();
+
+    uint8_t *pending = pPendingRAM.load(std::memory_order_acquire);
+    if (pending != NULL && (!available || !bFlipAtFrameStart || bDMDByte == 0)) {
+        publishDirty(bufferIndex(pending));
+        pFrontRAM.store(pending, std::memory_order_relaxed);
+        pPendingRAM.store(NULL, std::memory_order_release);
+    }
+    if (!available) return NULL;
+    const uint8_t *screen = pFrontRAM.load(std::memory_order_acquire);
+    DMD_STATS(ulPhaseStartNs = monotonicNs());
+
+    // Single buffer: with the refresh thread drawing runs concurrently (see publishDirty)
+    if (!bDoubleBuffered) publishDirty(0);
+    preparePhase(screen, bDMDByte);
+    return screen;
+}
+
+// Sends one chain's part of the current phase and keeps it lit for its window
+void DMD::outputPhase(int chain, const uint8_t *screen) {
+    DMDBackend *out = pChainOutput[chain];
+    unsigned int offset = uiChainFirst[chain] << 4;
+    int phaseBytes = uiChainPanels[chain] << 4;
+    uint8_t phase = bDMDByte;
+    uint8_t planes = bBitplanes;
+    uint8_t brightness = bBrightness;
+    uint64_t period = 1000000000ULL / (uiRefreshRate * 4);
+    if (brightness == 0) {
+        // Keep the shift registers and row select in step, but never enable the rows
+        sendPhase(out, phaseData(screen, 0, phase) + offset, phaseBytes);
+        latchPhase(out, phase, false);
+    } else if (planes == 1) {
+        sendPhase(out, phaseData(screen, 0, phase) + offset, phaseBytes);
+        latchPhase(out, phase);
+        if (brightness < DMD_MAX_BRIGHTNESS) {
+            waitUntil(monotonicNs() + period * brightness / DMD_MAX_BRIGHTNESS);
+            OE_DMD_ROWS_OFF(out);
+        }
+    } else {
+        uint64_t base = (period >> planes) * brightness / DMD_MAX_BRIGHTNESS;
+        uint64_t windowEnd = 0;
+        for (int plane = planes - 1; plane >= 0; plane--) {
+            sendPhase(out, phaseData(screen, plane, phase) + offset, phaseBytes);
+            if (windowEnd) waitUntil(windowEnd);
+            latchPhase(out, phase);
+            windowEnd = monotonicNs() + (base << plane);
         }
+        waitUntil(windowEnd);
+        OE_DMD_ROWS_OFF(out);
+    }
+}
+
+void DMD::endPhase() {
+    DMD_STATS(stats.recordPhase(bDMDByte, ulPhaseStartNs, monotonicNs(), 1000000000ULL / (uiRefreshRate * 4)));
+    bDMDByte = (bDMDByte + 1) & 3;
 
-        OE_DMD_ROWS_OFF(hChip);
-        LATCH_DMD_SHIFT_REG_TO_OUTPUT(hChip);
-        switch (bDMDByte) {
-            case 0: LIGHT_DMD_ROW_01_05_09_13(hChip); bDMDByte=1; break;
-            case 1: LIGHT_DMD_ROW_02_06_10_14(hChip); bDMDByte=2; break;
-            case 2: LIGHT_DMD_ROW_03_07_11_15(hChip); bDMDByte=3; break;
-            case 3: LIGHT_DMD_ROW_04_08_12_16(hChip); bDMDByte=0; break;
+    if (bDMDByte == 0) {
+        uiFrameCount++;
+        uint64_t now = monotonicNs();
+        if (now - ulFpsWindowStart >= 1000000000ULL) {
+            fFramesPerSecond = uiFrameCount * 1e9f / (float)(now - ulFpsWindowStart);
+            uiFrameCount = 0;
+            ulFpsWindowStart = now;
         }
-        OE_DMD_ROWS_ON(hChip);
+    }
+}
+
+void DMD::sendPhase(DMDBackend *out, const uint8_t *data, int length) {
+    DMD_STATS(uint64_t start = monotonicNs());
+    if (out->writeSPI(data, length)) {
+        DMD_STATS(DMDStats::add(stats.bytesSent, length));
+    } else {
+        DMD_STATS(DMDStats::add(stats.spiErrors, 1));
+    }
+    DMD_STATS(DMDStats::add(stats.spiNs, monotonicNs() - start));
+}
+
+void DMD::latchPhase(DMDBackend *out, uint8_t phase, bool light) {
+    DMD_STATS(uint64_t start = monotonicNs());
+    if (light) {
+        LATCH_AND_LIGHT_DMD_PHASE(out, phase);
+    } else {
+        LATCH_DMD_PHASE_DARK(out, phase);
+    }
+    DMD_STATS(DMDStats::add(stats.gpioNs, monotonicNs() - start));
+}
+
+void DMD::preparePhase(const uint8_t *screen, uint8_t phase) {
+    if (!bPackPhases) return;
+
+    int buffer = bufferIndex(screen);
+    uint8_t *stale = bStalePanels[buffer];
+    const unsigned int *phaseMap = uiPackMap + phase * row1;
+    bool packed = false;
+    for (int k = 0; k < DisplaysTotal; k++) {
+        if (!(stale[k] & (1 << phase))) continue;
+        stale[k] &= ~(1 << phase);
+        packed = true;
+        for (uint8_t plane = 0; plane < bBitplanes; plane++) {
+            const uint8_t *src = screen + plane * uiPlaneBytes;
+            const unsigned int *map = phaseMap + k * 16;
+            uint8_t *out = bSPIBuffer[buffer] + (plane * 4 + phase) * row1 + k * 16;
+            for (int i = 0; i < 16; i++) {
+                unsigned int offset = map[i];
+                uint8_t data = src[offset & ~DMD_PACK_REVERSE];
+                out[i] = (offset & DMD_PACK_REVERSE) ? bBitReverse[data] : data;
+            }
+        }
+    }
+    if (packed) DMDStats::add(ulPhasesPacked, 1);
+    else DMDStats::add(ulPhasesReused, 1);
+}
+
+const uint8_t* DMD::phaseData(const uint8_t *screen, uint8_t plane, uint8_t phase) {
+    if (!bPackPhases) return screen + plane * uiPlaneBytes + row1 * phase;
+    return bSPIBuffer[bufferIndex(screen)] + (plane * 4 + phase) * row1;
+}
+
+/*--------------------------------------------------------------------------------------
+ Statistics dump
+--------------------------------------------------------------------------------------*/
+void DMD::printStats(FILE *out) {
+    uint64_t phases = stats.phases.load(std::memory_order_relaxed);
+    uint64_t intervals = stats.intervals.load(std::memory_order_relaxed);
+    uint64_t minInterval = stats.intervalMinNs.load(std::memory_order_relaxed);
+
+    fprintf(out, "frames/s          %.1f (target %u)\n", fFramesPerSecond, uiRefreshRate);
+    fprintf(out, "phases            %llu\n", (unsigned long long)phases);
+    fprintf(out, "missed deadlines  %llu\n", (unsigned long long)stats.missedDeadlines.load(std::memory_order_relaxed));
+    fprintf(out, "bytes sent        %llu\n", (unsigned long long)stats.bytesSent.load(std::memory_order_relaxed));
+    fprintf(out, "spi errors        %llu\n", (unsigned long long)stats.spiErrors.load(std::memory_order_relaxed));
+    fprintf(out, "packed / reused   %llu / %llu\n", (unsigned long long)getPackedPhaseCount(),
+            (unsigned long long)getReusedPhaseCount());
+    if (phases) {
+        fprintf(out, "spi per phase     %.1f us\n", stats.spiNs.load(std::memory_order_relaxed) / 1000.0 / phases);
+        fprintf(out, "gpio per phase    %.1f us\n", stats.gpioNs.load(std::memory_order_relaxed) / 1000.0 / phases);
+    }
+    if (intervals) {
+        fprintf(out, "interval min/max  %.1f / %.1f us\n", minInterval / 1000.0,
+                stats.intervalMaxNs.load(std::memory_order_relaxed) / 1000.0);
+        fprintf(out, "jitter mean/max   %.1f / %.1f us\n", stats.jitterSumNs.load(std::memory_order_relaxed) / 1000.0 / intervals,
+                stats.jitterMaxNs.load(std::memory_order_relaxed) / 1000.0);
+    }
+    fprintf(out, "phase duration    us:   phase 0   phase 1   phase 2   phase 3\n");
+    for (int b = 0; b < DMD_STATS_BUCKETS; b++) {
+        uint64_t counts[4];
+        uint64_t total = 0;
+        for (int p = 0; p < 4; p++) total += counts[p] = stats.phaseHistogram[p][b].load(std::memory_order_relaxed);
+        if (!total) continue;
+        if (b == 0) fprintf(out, "              < %6u", 2u);
+        else if (b == DMD_STATS_BUCKETS - 1) fprintf(out, "             >= %6u", 1u << b);
+        else fprintf(out, "       %6u - %6u", 1u << b, (2u << b) - 1);
+        for (int p = 0; p < 4; p++) fprintf(out, " %9llu", (unsigned long long)counts[p]);
+        fprintf(out, "\n");
+    }
+}
+
+/*--------------------------------------------------------------------------------------
+ Chains
+--------------------------------------------------------------------------------------*/
+bool DMD::setChains(int count, DMDBackend **backends, const uint16_t *panels) {
+    if (bRefreshRunning.load(std::memory_order_acquire) || count < 1 || count > DMD_MAX_CHAINS) return false;
+    int total = 0;
+    for (int c = 0; c < count; c++) {
+        if (panels[c] == 0 || (c > 0 && backends[c] == NULL)) return false;
+        total += panels[c];
+    }
+    if (total != DisplaysTotal) {
+        fprintf(stderr, "setChains: %d panels in chains, wall has %d\n", total, DisplaysTotal);
+        return false;
+    }
+    for (int c = 0; c < count; c++) {
+        if (backends[c] != NULL && backends[c] != pOutput && !backends[c]->open()) return false;
+    }
+
+    uint16_t first = 0;
+    for (int c = 0; c < count; c++) {
+        pChainOutput[c] = (backends[c] != NULL) ? backends[c] : pOutput;
+        uiChainFirst[c] = first;
+        uiChainPanels[c] = panels[c];
+        first += panels[c];
+    }
+    bChains = count;
+    return true;
+}
+
+/*--------------------------------------------------------------------------------------
+ Refresh thread
+
+ Scans one phase per tick with absolute deadlines (CLOCK_MONOTONIC), so the interval
+ between phases does not drift with the time spent in scanDisplayBySPI(). When a
+ deadline is missed the schedule is re-based on the current time instead of
+ bursting through the backlog of phases.
+
+ With several chains this thread packs the phase, releases the chain threads by
+ bumping uiChainGeneration, sends chain 0 itself and waits for the others before
+ moving on, so every chain always shows the same phase.
+--------------------------------------------------------------------------------------*/
+void DMD::setRefreshRate(unsigned int framesPerSecond) {
+    uiRefreshRate = framesPerSecond ? framesPerSecond : DMD_DEFAULT_REFRESH_HZ;
+}
+
+bool DMD::startRefresh(unsigned int framesPerSecond, int priority, int cpu, bool lockMemory) {
+    if (bRefreshRunning.load(std::memory_order_acquire)) return true;
+    if (!bOutputOpen) return false;
+    setRefreshRate(framesPerSecond);
+    iRefreshPriority = priority;
+    iRefreshCpu = cpu;
+
+    if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) perror("mlockall");
+
+    // Set before the thread starts and cleared only after it is joined, so every mark
+    // the thread can take is a release (see publishDirty)
+    if (!bDoubleBuffered) bSharedMarks = true;
+    bRefreshRunning.store(true, std::memory_order_release);
+    bChainsStop = false;
+    uiChainGeneration = 0;
+    iChainThreads = 0;
+    int err = 0;
+    for (int c = 1; c < bChains && err == 0; c++) {
+        chainArgs[c].dmd = this;
+        chainArgs[c].chain = c;
+        err = pthread_create(&chainThreads[c], NULL, chainThreadEntry, &chainArgs[c]);
+        if (err == 0) iChainThreads++;
+    }
+    if (err == 0) err = pthread_create(&refreshThread, NULL, refreshThreadEntry, this);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        bRefreshRunning.store(false, std::memory_order_release);
+        pthread_mutex_lock(&chainMutex);
+        bChainsStop = true;
+        pthread_cond_broadcast(&chainStart);
+        pthread_mutex_unlock(&chainMutex);
+        for (int c = 1; c <= iChainThreads; c++) pthread_join(chainThreads[c], NULL);
+        iChainThreads = 0;
+        bSharedMarks = false;
+        return false;
+    }
+    return true;
+}
+
+void DMD::stopRefresh() {
+    if (!bRefreshRunning.load(std::memory_order_acquire)) return;
+    bRefreshRunning.store(false, std::memory_order_release);
+    pthread_join(refreshThread, NULL);
+
+    pthread_mutex_lock(&chainMutex);
+    bChainsStop = true;
+    pthread_cond_broadcast(&chainStart);
+    pthread_mutex_unlock(&chainMutex);
+    for (int c = 1; c <= iChainThreads; c++) pthread_join(chainThreads[c], NULL);
+    iChainThreads = 0;
+    bSharedMarks = false;
+}
+
+void* DMD::refreshThreadEntry(void *arg) {
+    ((DMD*)arg)->refreshLoop();
+    return NULL;
+}
+
+void* DMD::chainThreadEntry(void *arg) {
+    ChainThreadArg *chain = (ChainThreadArg*)arg;
+    chain->dmd->chainLoop(chain->chain);
+    return NULL;
+}
+
+void DMD::configureThread(int cpu) {
+    int err;
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+    }
+    if (iRefreshPriority > 0) {
+        struct sched_param param;
+        param.sched_priority = iRefreshPriority;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) fprintf(stderr, "pthread_setschedparam: %s\n", strerror(err));
+    }
+}
+
+void DMD::refreshLoop() {
+    configureThread(iRefreshCpu);
+
+    uint64_t period = 1000000000ULL / (uiRefreshRate * 4);
+    uint64_t deadline = monotonicNs();
+    while (bRefreshRunning.load(std::memory_order_acquire)) {
+        if (bChains == 1) {
+            scanDisplayBySPI();
+        } else {
+            const uint8_t *screen = beginPhase();
+            if (screen != NULL) {
+                pthread_mutex_lock(&chainMutex);
+                pChainScreen = screen;
+                iChainsPending = bChains - 1;
+                uiChainGeneration++;
+                pthread_cond_broadcast(&chainStart);
+                pthread_mutex_unlock(&chainMutex);
+
+                outputPhase(0, screen);
+
+                pthread_mutex_lock(&chainMutex);
+                while (iChainsPending > 0) pthread_cond_wait(&chainDone, &chainMutex);
+                pthread_mutex_unlock(&chainMutex);
+                endPhase();
+            }
+        }
+
+        deadline += period;
+        uint64_t now = monotonicNs();
+        if (now >= deadline) {
+            DMD_STATS(if (now > deadline) DMDStats::add(stats.missedDeadlines, 1));
+            deadline = now;
+            continue;
+        }
+        waitUntil(deadline);
+    }
+}
+
+void DMD::chainLoop(int chain) {
+    configureThread(iRefreshCpu >= 0 ? iRefreshCpu + chain : -1);
+
+    unsigned int generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&chainMutex);
+        while (uiChainGeneration == generation && !bChainsStop) pthread_cond_wait(&chainStart, &chainMutex);
+        if (bChainsStop) {
+            pthread_mutex_unlock(&chainMutex);
+            break;
+        }
+        generation = uiChainGeneration;
+        const uint8_t *screen = pChainScreen;
+        pthread_mutex_unlock(&chainMutex);
+
+        outputPhase(chain, screen);
+
+        pthread_mutex_lock(&chainMutex);
+        if (--iChainsPending == 0) pthread_cond_signal(&chainDone);
+        pthread_mutex_unlock(&chainMutex);
     }
 }
 
 /*--------------------------------------------------------------------------------------
  Font handling
 --------------------------------------------------------------------------------------*/
-void DMD::selectFont(const uint8_t * font) { this->Font = font; }
+void DMD::selectFont(const uint8_t * font) {
+    this->Font = font;
+    pFontAtlas = fontAtlas(font);
+}
+
+bool DMD::prepareFont(const uint8_t *font) { return fontAtlas(font) != NULL; }
+
+void DMD::setFontFallback(const uint8_t *const *fonts, int count) {
+    if (count > DMD_MAX_FALLBACK_FONTS) count = DMD_MAX_FALLBACK_FONTS;
+    bFallbackFonts = 0;
+    for (int i = 0; i < count; i++) {
+        DMDFontAtlas *a = fontAtlas(fonts[i]);
+        if (a == NULL) continue;
+        pFallbackFonts[bFallbackFonts] = fonts[i];
+        pFallbackAtlas[bFallbackFonts++] = a;
+    }
+}
+
+bool DMD::atlasInUse(const DMDFontAtlas *atlas) const {
+    if (atlas == pFontAtlas) return true;
+    for (int i = 0; i < bFallbackFonts; i++)
+        if (atlas == pFallbackAtlas[i]) return true;
+    return false;
+}
+
+// The current font, then the fallback fonts; failing that the same for the plain letter
+bool DMD::findGlyph(uint32_t codePoint, DMDFontAtlas *&atlas, unsigned int &glyph) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int f = -1; f < bFallbackFonts; f++) {
+            DMDFontAtlas *a = f < 0 ? pFontAtlas : pFallbackAtlas[f];
+            unsigned int g = codePoint - a->firstChar;
+            if (codePoint < 256 && g < a->charCount && a->width[g] > 0) {
+                atlas = a;
+                glyph = g;
+                return true;
+            }
+        }
+        if (codePoint < 0xC0 || codePoint >= 0x180 || bBaseLetter[codePoint - 0xC0] == 0) return false;
+        codePoint = (uint8_t) bBaseLetter[codePoint - 0xC0];
+    }
+    return false;
+}
+
+// Width of a character as drawCodePoint() draws it, ' ' as wide as 'n'
+int DMD::codePointWidth(uint32_t codePoint) {
+    if (pFontAtlas == NULL) return codePoint < 256 ? charWidth(codePoint) : 0;
+    if (codePoint < 256 && (pFontAtlas->charWidths[codePoint] > 0 || codePoint == ' '))
+        return pFontAtlas->charWidths[codePoint];
+    DMDFontAtlas *a;
+    unsigned int glyph;
+    return findGlyph(codePoint, a, glyph) ? a->width[glyph] : 0;
+}
+
+// Returns the cached atlas of font, transcoding it on first use. The glyph bits are
+// placed exactly where drawCharGlyph() plots them, so drawChar() becomes one blit.
+DMDFontAtlas* DMD::fontAtlas(const uint8_t *font) {
+    for (int i = 0; i < DMD_FONT_CACHE; i++)
+        if (fontAtlases[i].font == font) return &fontAtlases[i];
+
+    // Reuse the slots in turn, never the ones of the selected and fallback fonts
+    DMDFontAtlas *a = &fontAtlases[bNextAtlas];
+    while (atlasInUse(a)) a = &fontAtlases[bNextAtlas = (bNextAtlas + 1) % DMD_FONT_CACHE];
+    bNextAtlas = (bNextAtlas + 1) % DMD_FONT_CACHE;
+    free(a->x);
+    memset(a, 0, sizeof(*a));
+
+    uint8_t height = font[FONT_HEIGHT];
+    uint8_t bytes = (height + 7) / 8;
+    uint8_t charCount = font[FONT_CHAR_COUNT];
+    bool fixed = font[FONT_LENGTH] == 0 && font[FONT_LENGTH + 1] == 0;
+    unsigned int total = 0;
+    for (int c = 0; c < charCount; c++) total += fixed ? font[FONT_FIXED_WIDTH] : font[FONT_WIDTH_TABLE + c];
+
+    a->firstChar = font[FONT_FIRST_CHAR];
+    a->charCount = charCount;
+    a->rows = bytes > 1 ? height : (height > 7 ? 8 : height + 1);
+    a->stride = (total + 7) / 8;
+    uint8_t *block = (uint8_t*) calloc(1, charCount * (sizeof(uint16_t) + 1) + a->rows * a->stride + 1);
+    if (block == NULL) {
+        perror("DMD font cache");
+        return NULL;
+    }
+    a->x = (uint16_t*) block;
+    a->width = block + charCount * sizeof(uint16_t);
+    a->bits = a->width + charCount;
+
+    const uint8_t *glyph = font + FONT_WIDTH_TABLE + (fixed ? 0 : charCount);
+    unsigned int x = 0;
+    for (int c = 0; c < charCount; c++) {
+        uint8_t width = fixed ? font[FONT_FIXED_WIDTH] : font[FONT_WIDTH_TABLE + c];
+        a->x[c] = x;
+        a->width[c] = width;
+        for (uint8_t j = 0; j < width; j++, x++) {
+            for (uint8_t i = 0; i < bytes; i++) {
+                uint8_t data = glyph[j + (i * width)];
+                int offset = (i * 8);
+                if ((i == bytes - 1) && bytes > 1) offset = height - 8;
+                for (uint8_t k = 0; k < 8; k++) {
+                    if ((offset+k >= i*8) && (offset+k <= height) && (data & (1 << k)))
+                        a->bits[(offset + k) * a->stride + (x >> 3)] |= 0x80 >> (x & 7);
+                }
+            }
+        }
+        glyph += width * bytes;
+    }
+    for (int c = 0; c < 256; c++) {
+        unsigned int g = (uint8_t)((c == ' ' ? 'n' : c) - a->firstChar);
+        a->charWidths[c] = g < charCount ? a->width[g] : 0;
+    }
+    a->font = font;
+    return a;
+}
 
 int DMD::drawChar(const int bX, const int bY, const unsigned char letter, uint8_t bGraphicsMode) {
+    return drawCodePoint(bX, bY, letter, bGraphicsMode);
+}
+
+int DMD::drawCodePoint(int bX, int bY, uint32_t codePoint, uint8_t bGraphicsMode) {
     if (bX > (DMD_PIXELS_ACROSS*DisplaysWide) || bY > (DMD_PIXELS_DOWN*DisplaysHigh) ) return -1;
-    unsigned char c = letter;
     uint8_t height = *(this->Font + FONT_HEIGHT);
-    if (c == ' ') {
+    if (codePoint == ' ') {
         int charWide = charWidth(' ');
         this->drawFilledBox(bX, bY, bX + charWide, bY + height, GRAPHICS_INVERSE);
         return charWide;
     }
     uint8_t width = 0;
-    uint8_t bytes = (height + 7) / 8;
+    if (pFontAtlas != NULL) {
+        DMDFontAtlas *a;
+        unsigned int glyph;
+        if (!findGlyph(codePoint, a, glyph)) return 0;
+        width = a->width[glyph];
+        if (bX < -width || bY < -height) return width;
+        // A glyph from a fallback font gets the rows of the current one, as in layoutText()
+        int rows = a->rows < pFontAtlas->rows ? a->rows : pFontAtlas->rows;
+        blit(bX, bY, a->bits, a->stride, width, rows, bGraphicsMode, a->x[glyph]);
+        return width;
+    }
 
+    // No atlas: decode the glyph straight from the current font
+    uint8_t bytes = (height + 7) / 8;
     uint8_t firstChar = *(this->Font + FONT_FIRST_CHAR);
     uint8_t charCount = *(this->Font + FONT_CHAR_COUNT);
-
     uint16_t index = 0;
 
-    if (c < firstChar || c >= (firstChar + charCount)) return 0;
-    c -= firstChar;
+    if (codePoint < firstChar || codePoint >= (unsigned int)(firstChar + charCount)) return 0;
+    uint8_t c = codePoint - firstChar;
 
     if (*(this->Font + FONT_LENGTH) == 0 && *(this->Font + FONT_LENGTH + 1) == 0) {
         width = *(this->Font + FONT_FIXED_WIDTH);
@@ -370,23 +1948,27 @@ int DMD::drawChar(const int bX, const int bY, const unsigned char letter, uint8_
     }
     if (bX < -width || bY < -height) return width;
 
+    DMD_WITH_OP(bGraphicsMode, drawCharGlyph<Op>(bX, bY, this->Font + index, width, height, bytes));
+    return width;
+}
+
+template <class Op>
+void DMD::drawCharGlyph(int bX, int bY, const uint8_t *glyph, uint8_t width, uint8_t height, uint8_t bytes) {
     for (uint8_t j = 0; j < width; j++) {
         for (uint8_t i = bytes - 1; i < 254; i--) {
-            uint8_t data = *(this->Font + index + j + (i * width));
+            uint8_t data = glyph[j + (i * width)];
             int offset = (i * 8);
             if ((i == bytes - 1) && bytes > 1) offset = height - 8;
             for (uint8_t k = 0; k < 8; k++) {
-                if ((offset+k >= i*8) && (offset+k <= height)) {
-                    if (data & (1 << k)) writePixel(bX + j, bY + offset + k, bGraphicsMode, true);
-                    else writePixel(bX + j, bY + offset + k, bGraphicsMode, false);
-                }
+                if ((offset+k >= i*8) && (offset+k <= height))
+                    plotPixel<Op>(bX + j, bY + offset + k, data & (1 << k));
             }
         }
     }
-    return width;
 }
 
 int DMD::charWidth(const unsigned char letter) {
+    if (pFontAtlas != NULL) return codePointWidth(letter);
     unsigned char c = letter;
     if (c == ' ') c = 'n';
     uint8_t width = 0;
@@ -403,4 +1985,22 @@ int DMD::charWidth(const unsigned char letter) {
         width = *(this->Font + FONT_WIDTH_TABLE + c);
     }
     return width;
-}
\ No newline at end of file
+}
+
+int DMD::stringWidth(const char *bChars, unsigned int length) {
+    int width = 0;
+    const uint8_t *widths = pFontAtlas != NULL ? pFontAtlas->charWidths : NULL;
+    for (unsigned int i = 0; i < length; ) {
+        // ASCII characters of the current font straight from its width table
+        uint8_t c = bChars[i];
+        int charWide;
+        if (widths != NULL && c < 0x80 && (widths[c] > 0 || c == ' ')) {
+            charWide = widths[c];
+            i++;
+        } else {
+            charWide = codePointWidth(utf8Next(bChars, length, i));
+        }
+        if (charWide > 0) width += charWide + 1;
+    }
+    return width > 0 ? width - 1 : 0;
+}
@@ -3,7 +3,11 @@
 
 #include <stdint.h>
 #include <string.h>
-#include <lgpio.h>
+#include <pthread.h>
+#include <atomic>
+#include "DMDStats.h"
+
+class DMDBackend;
 
 // ============================================================================
 // KONFIGURACJA PINÓW RASPBERRY PI (BCM numbering)
@@ -16,17 +20,47 @@
 #define PIN_DMD_R_DATA    10    // SPI0_MOSI (sprzętowy)
 #define PIN_OTHER_SPI_nCS 8     // SPI0_CE0
 
+#ifndef SPI_BUS
+#define SPI_BUS           0     // /dev/spidev0.x
+#endif
+#ifndef SPI_CHIP
+#define SPI_CHIP          0     // CE0
+#endif
+#ifndef SPI_SPEED
+#define SPI_SPEED         4000000
+#endif
+
 // ============================================================================
 // Makra sterujące GPIO
 // ============================================================================
-#define LIGHT_DMD_ROW_01_05_09_13(chip) { lgGpioWrite(chip, PIN_DMD_B, 0); lgGpioWrite(chip, PIN_DMD_A, 0); }
-#define LIGHT_DMD_ROW_02_06_10_14(chip) { lgGpioWrite(chip, PIN_DMD_B, 0); lgGpioWrite(chip, PIN_DMD_A, 1); }
-#define LIGHT_DMD_ROW_03_07_11_15(chip) { lgGpioWrite(chip, PIN_DMD_B, 1); lgGpioWrite(chip, PIN_DMD_A, 0); }
-#define LIGHT_DMD_ROW_04_08_12_16(chip) { lgGpioWrite(chip, PIN_DMD_B, 1); lgGpioWrite(chip, PIN_DMD_A, 1); }
+// Linie A, B, SCLK i nOE zmieniają się zawsze razem, jednym zapisem do backendu
+// (DMDBackend::writeControl). Bity grupy:
+#define DMD_GROUP_A       0x01
+#define DMD_GROUP_B       0x02
+#define DMD_GROUP_SCLK    0x04
+#define DMD_GROUP_nOE     0x08
+#define DMD_GROUP_ALL     (DMD_GROUP_A | DMD_GROUP_B | DMD_GROUP_SCLK | DMD_GROUP_nOE)
+#define DMD_GROUP_WRITE(out, bits, mask) (out)->writeControl(bits, mask)
+
+#define LIGHT_DMD_ROW_01_05_09_13(out) { DMD_GROUP_WRITE(out, 0, DMD_GROUP_A | DMD_GROUP_B); }
+#define LIGHT_DMD_ROW_02_06_10_14(out) { DMD_GROUP_WRITE(out, DMD_GROUP_A, DMD_GROUP_A | DMD_GROUP_B); }
+#define LIGHT_DMD_ROW_03_07_11_15(out) { DMD_GROUP_WRITE(out, DMD_GROUP_B, DMD_GROUP_A | DMD_GROUP_B); }
+#define LIGHT_DMD_ROW_04_08_12_16(out) { DMD_GROUP_WRITE(out, DMD_GROUP_A | DMD_GROUP_B, DMD_GROUP_A | DMD_GROUP_B); }
+
+#define LATCH_DMD_SHIFT_REG_TO_OUTPUT(out) { DMD_GROUP_WRITE(out, DMD_GROUP_SCLK, DMD_GROUP_SCLK); DMD_GROUP_WRITE(out, 0, DMD_GROUP_SCLK); }
+#define OE_DMD_ROWS_OFF(out) { DMD_GROUP_WRITE(out, 0, DMD_GROUP_nOE); }
+#define OE_DMD_ROWS_ON(out)  { DMD_GROUP_WRITE(out, DMD_GROUP_nOE, DMD_GROUP_nOE); }
+
+// Przełączenie fazy w dwóch zapisach: wygaszenie, zbocze zatrzasku i wybór linii naraz,
+// potem opadające SCLK razem z ponownym włączeniem. Bity A/B fazy to numer fazy (0..3).
+#define LATCH_AND_LIGHT_DMD_PHASE(out, phase) { \
+    DMD_GROUP_WRITE(out, DMD_GROUP_SCLK | ((phase) & 3), DMD_GROUP_ALL); \
+    DMD_GROUP_WRITE(out, DMD_GROUP_nOE, DMD_GROUP_SCLK | DMD_GROUP_nOE); }
 
-#define LATCH_DMD_SHIFT_REG_TO_OUTPUT(chip) { lgGpioWrite(chip, PIN_DMD_SCLK, 1); lgGpioWrite(chip, PIN_DMD_SCLK, 0); }
-#define OE_DMD_ROWS_OFF(chip) { lgGpioWrite(chip, PIN_DMD_nOE, 0); }
-#define OE_DMD_ROWS_ON(chip)  { lgGpioWrite(chip, PIN_DMD_nOE, 1); }
+// To samo bez włączania - wiersze zostają zgaszone (jasność 0)
+#define LATCH_DMD_PHASE_DARK(out, phase) { \
+    DMD_GROUP_WRITE(out, DMD_GROUP_SCLK | ((phase) & 3), DMD_GROUP_ALL); \
+    DMD_GROUP_WRITE(out, 0, DMD_GROUP_SCLK); }
 
 // ============================================================================
 // Tryby grafiki
@@ -37,6 +71,53 @@
 #define GRAPHICS_OR        3
 #define GRAPHICS_NOR       4
 
+// Tryby grafiki jako typy: on/off zmieniają bity mask dla piksela zapalonego / zgaszonego
+// (bit 0 = dioda świeci). DMD_WITH_OP wybiera typ raz, a pętle rysujące są konkretyzowane
+// osobno dla każdego trybu - bez switch na każdy piksel.
+// blend: wiele pikseli naraz - bajt/słowo/wektor d ekranu, bity źródła s (1 = zapalony),
+// zmieniane tylko bity m.
+struct DMDOpNormal {
+    static inline void on(uint8_t *p, uint8_t m)  { *p &= ~m; }
+    static inline void off(uint8_t *p, uint8_t m) { *p |= m; }
+    template <class T> static inline T blend(T d, T s, T m) { return (d & ~m) | (~s & m); }
+};
+struct DMDOpInverse {
+    static inline void on(uint8_t *p, uint8_t m)  { *p |= m; }
+    static inline void off(uint8_t *p, uint8_t m) { *p &= ~m; }
+    template <class T> static inline T blend(T d, T s, T m) { return (d & ~m) | (s & m); }
+};
+struct DMDOpToggle {
+    static inline void on(uint8_t *p, uint8_t m)  { *p ^= m; }
+    static inline void off(uint8_t *, uint8_t)    {}
+    template <class T> static inline T blend(T d, T s, T m) { return d ^ (s & m); }
+};
+struct DMDOpOr {
+    static inline void on(uint8_t *p, uint8_t m)  { *p &= ~m; }
+    static inline void off(uint8_t *, uint8_t)    {}
+    template <class T> static inline T blend(T d, T s, T m) { return d & ~(s & m); }
+};
+struct DMDOpNor {
+    static inline void on(uint8_t *p, uint8_t m)  { *p |= m; }
+    static inline void off(uint8_t *, uint8_t)    {}
+    template <class T> static inline T blend(T d, T s, T m) { return d | (s & m); }
+};
+
+template <class Op>
+static inline void dmdRasterOp(uint8_t *p, uint8_t m, uint8_t bPixel) {
+    if (bPixel) Op::on(p, m);
+    else Op::off(p, m);
+}
+
+// Wykonuje instrukcję z typem Op odpowiadającym trybowi mode
+#define DMD_WITH_OP(mode, ...) \
+    switch (mode) { \
+        case GRAPHICS_NORMAL:  { typedef DMDOpNormal Op;  __VA_ARGS__; } break; \
+        case GRAPHICS_INVERSE: { typedef DMDOpInverse Op; __VA_ARGS__; } break; \
+        case GRAPHICS_TOGGLE:  { typedef DMDOpToggle Op;  __VA_ARGS__; } break; \
+        case GRAPHICS_OR:      { typedef DMDOpOr Op;      __VA_ARGS__; } break; \
+        case GRAPHICS_NOR:     { typedef DMDOpNor Op;     __VA_ARGS__; } break; \
+    }
+
 // Wzory testowe
 #define PATTERN_ALT_0     0
 #define PATTERN_ALT_1     1
@@ -48,9 +129,38 @@
 // ============================================================================
 #define DMD_PIXELS_ACROSS 32
 #define DMD_PIXELS_DOWN   16
-#define DMD_BITSPERPIXEL  1
+#define DMD_BITSPERPIXEL  1     // bitów na piksel w jednym bitplanie
+#define DMD_MAX_BITPLANES 4     // odcienie szarości: do 16 poziomów jasności
+#define DMD_ALL_PHASES    0x0F
 #define DMD_RAM_SIZE_BYTES ((DMD_PIXELS_ACROSS * DMD_BITSPERPIXEL / 8) * DMD_PIXELS_DOWN)
 
+// Układ bufora ekranu
+#define DMD_LAYOUT_ROWS   0   // wiersz po wierszu, faza składana przy każdym skanowaniu
+#define DMD_LAYOUT_WIRE   1   // każda faza ciągła, w kolejności bajtów na SPI (skan bez kopiowania)
+#define DMD_PACK_REVERSE  0x80000000u   // znacznik w uiPackMap: bajt z odwróconą kolejnością bitów
+
+// Orientacja panelu w ścianie (setTopology). Obrót o 90° nie jest możliwy - panel nie jest kwadratowy.
+#define DMD_PANEL_NORMAL      0
+#define DMD_PANEL_MIRROR_X    1   // kolumny w odwrotnej kolejności
+#define DMD_PANEL_MIRROR_Y    2   // wiersze w odwrotnej kolejności
+#define DMD_PANEL_ROTATE_180  (DMD_PANEL_MIRROR_X | DMD_PANEL_MIRROR_Y)
+
+// Miejsce panelu na ścianie; tablica dla setTopology() ma jeden wpis na każdą pozycję
+// w łańcuchu, w kolejności domyślnej (pozycja k = panel k przy układzie od lewej do prawej,
+// z góry na dół)
+struct DMDPanelPlacement {
+    uint16_t x;             // kolumna panelu (0 .. panelsWide-1)
+    uint16_t y;             // wiersz panelu (0 .. panelsHigh-1)
+    uint8_t orientation;    // DMD_PANEL_*
+};
+
+// Panel ściany pokazywany na danej pozycji łańcucha (wewnętrzne, z setTopology);
+// phaseFlip gdy wiersze są odwrócone - faza p panelu to wtedy faza 3-p ściany
+struct DMDPanelSlot {
+    uint16_t panel;
+    uint8_t phaseFlip;
+};
+
 static uint8_t bPixelLookupTable[8] =
 {
    0x80,   // bit 7
@@ -63,6 +173,14 @@ static uint8_t bPixelLookupTable[8] =
    0x01    // bit 0
 };
 
+// ============================================================================
+// Odświeżanie w tle
+// ============================================================================
+#define DMD_DEFAULT_REFRESH_HZ  200   // pełne ramki (4 fazy) na sekundę
+#define DMD_SPI_MAX_TRANSFER    4096  // domyślny rozmiar bufora spidev (bufsiz)
+#define DMD_MAX_BRIGHTNESS      255
+#define DMD_MAX_CHAINS          8     // łańcuchy paneli skanowane równolegle (setChains)
+
 // ============================================================================
 // Stałe dla fontów
 // ============================================================================
@@ -75,27 +193,218 @@ static uint8_t bPixelLookupTable[8] =
 
 typedef uint8_t (*FontCallback)(const uint8_t*);
 
+// Fonty zapasowe (setFontFallback) - sprawdzane po kolei dla znaków spoza bieżącego fontu
+#define DMD_MAX_FALLBACK_FONTS  4
+
+// Font przepisany przez selectFont() na bitmapę wierszami (format blit): glify obok
+// siebie w jednym pasie, glif c od kolumny x[c] (suma szerokości poprzednich).
+// DMD trzyma kilka takich naraz.
+#define DMD_FONT_CACHE          8
+
+struct DMDFontAtlas {
+    const uint8_t *font;        // NULL = wolny wpis
+    uint8_t firstChar;
+    uint8_t charCount;
+    uint8_t rows;               // wiersze rysowane przez drawChar (FONT_HEIGHT lub +1)
+    unsigned int stride;        // bajtów na wiersz pasa
+    uint16_t *x;
+    uint8_t *width;
+    uint8_t *bits;              // rows * stride
+    uint8_t charWidths[256];    // charWidth() dla każdego bajtu, 0 = brak glifu
+};
+
+// ============================================================================
+// Układ tekstu w prostokącie (layoutText / drawText)
+// ============================================================================
+// Flagi: wyrównanie w poziomie | wyrównanie w pionie | DMD_TEXT_WRAP. Bez WRAP wiersze
+// kończy tylko '\n'; z WRAP także słowo, które nie mieści się w szerokości (słowo
+// dłuższe od prostokąta jest łamane między znakami).
+#define DMD_TEXT_LEFT           0x00
+#define DMD_TEXT_CENTER         0x01
+#define DMD_TEXT_RIGHT          0x02
+#define DMD_TEXT_TOP            0x00
+#define DMD_TEXT_MIDDLE         0x04
+#define DMD_TEXT_BOTTOM         0x08
+#define DMD_TEXT_WRAP           0x10
+
+// Wynik layoutText(): cały blok tekstu wyrenderowany raz do bitmapy 1 bit/piksel
+// (format blit) i jego widoczna, przycięta część. drawLayout() to jeden blit;
+// drawText() układa od nowa tylko gdy zmieniły się dane wejściowe.
+// Obiekt należy do wywołującego.
+struct DMDTextLayout {
+    DMDTextLayout();
+    ~DMDTextLayout();
+
+    // Rozmiar bloku tekstu przed przycięciem do prostokąta
+    unsigned int lines;
+    int textWidth;
+    int textHeight;
+
+    // Blok tekstu: textHeight wierszy po stride bajtów
+    uint8_t *bits;
+    unsigned int stride;
+    unsigned int bitsCapacity;
+
+    // Widoczna część: (clipX, clipY) na ekranie, od (srcX, srcY) w bloku
+    int clipX, clipY, clipWidth, clipHeight;
+    int srcX, srcY;
+
+    // Dane wejściowe ostatniego układu
+    const uint8_t *font;
+    char *text;
+    unsigned int textLength;
+    unsigned int textCapacity;
+    int boxX, boxY, boxWidth, boxHeight;
+    uint8_t flags;
+
+private:
+    DMDTextLayout(const DMDTextLayout &);
+    DMDTextLayout& operator=(const DMDTextLayout &);
+};
+
+// Obszary przewijania (setMarquee) - obszar 0 to ten z drawMarquee/stepMarquee
+#define DMD_MAX_MARQUEES        4
+// Prędkość obszaru w 1/DMD_MARQUEE_SUBSTEPS piksela na krok stepMarquees()
+#define DMD_MARQUEE_SUBSTEPS    16
+
+// Tekst przewijany: pasek wyrenderowany raz przez layoutText() i jego położenie
+// względem prostokąta, w którym się przesuwa
+struct DMDMarquee {
+    DMDTextLayout strip;
+    int x, y, width, height;    // prostokąt na ekranie
+    int offsetX, offsetY;       // lewy górny róg paska względem prostokąta
+    int gap;                    // >= 0: kopie paska co szerokość + gap pikseli
+    int speedX, speedY;         // przesunięcie na krok stepMarquees() (1/DMD_MARQUEE_SUBSTEPS piksela)
+    int fracX, fracY;           // niewykorzystana część przesunięcia
+    bool active;
+};
+
+// Warstwy (setLayer) składane przez compose() na ekran
+#define DMD_MAX_LAYERS          8
+// Zmienione prostokąty czekające na compose(); nadmiarowe są dołączane do istniejących
+#define DMD_MAX_DIRTY_RECTS     16
+
+// Warstwa: bitmapa 1 bit/piksel (format blit, 1 = zapalony) położona na ekranie
+struct DMDLayer {
+    uint8_t *bits;              // NULL = wolny wpis; height wierszy po stride bajtów
+    unsigned int stride;
+    int width, height;
+    int x, y;                   // lewy górny róg na ekranie
+    int z;                      // kolejność składania (większe na wierzchu)
+    uint8_t mode;               // GRAPHICS_*: jak warstwa łączy się z warstwami pod nią
+    bool visible;
+};
+
+// Prostokąt [x1, x2) x [y1, y2) na ekranie
+struct DMDRect {
+    int x1, y1, x2, y2;
+};
+
 // ============================================================================
 // Klasa główna DMD
 // ============================================================================
 class DMD {
 public:
-    DMD(uint8_t panelsWide, uint8_t panelsHigh);
+    // backend: wyjście SPI/GPIO (DMDBackend.h); NULL = lgpio, a przy DMD_NO_LGPIO spidev.
+    // Przekazany backend pozostaje własnością wywołującego. Konstruktor otwiera backend;
+    // gdy się nie uda (przyczyna wypisana przez perror), isOpen() zwraca false, a
+    // skanowanie nic nie wysyła - begin() próbuje otworzyć ponownie.
+    DMD(uint16_t panelsWide, uint16_t panelsHigh, uint8_t layout = DMD_LAYOUT_ROWS, DMDBackend *backend = NULL);
     ~DMD();
 
+    bool begin();
+    bool isOpen() const { return bOutputOpen; }
+
     // Pixel / grafika
     void writePixel(unsigned int bX, unsigned int bY, uint8_t bGraphicsMode, uint8_t bPixel);
+    // count pikseli (xs[i], ys[i]) w jednym trybie; punkty poza ekranem są pomijane
+    void writePixels(const int *xs, const int *ys, unsigned int count, uint8_t bGraphicsMode, uint8_t bPixel = true);
+    void writePixelIntensity(unsigned int bX, unsigned int bY, uint8_t intensity);
     void clearScreen(uint8_t bNormal);
 
-    // Tekst
-    void drawString(int bX, int bY, const char* bChars, uint8_t length, uint8_t bGraphicsMode);
+    // Odcienie szarości (BCM): 1 = tryb jednobitowy, 2..DMD_MAX_BITPLANES bitplanów
+    void setGrayscale(uint8_t bitplanes);
+    uint8_t getMaxIntensity() const { return (1 << bBitplanes) - 1; }
+
+    // Tekst. Napisy są w UTF-8; bajty, które nie tworzą poprawnej sekwencji, są brane
+    // jako znaki ISO-8859-1. Fonty mają glify dla kodów 0..255 (Unicode = ISO-8859-1);
+    // znaku brakującego w foncie szuka się w fontach zapasowych, a na końcu rysuje się
+    // literę bez znaków diakrytycznych (ą -> a, Ł -> L, é -> e).
+    void drawString(int bX, int bY, const char* bChars, unsigned int length, uint8_t bGraphicsMode);
+    // Wybiera font; przy pierwszym użyciu przepisuje go do pamięci podręcznej
     void selectFont(const uint8_t* font);
+    // Przepisuje font do pamięci podręcznej bez wybierania (np. wszystkie przy starcie)
+    bool prepareFont(const uint8_t* font);
+    // fonts[0..count-1] przeszukiwane po kolei, gdy bieżący font nie ma znaku; count = 0 wyłącza
+    void setFontFallback(const uint8_t* const* fonts, int count);
+    // letter: znak ISO-8859-1
     int drawChar(const int bX, const int bY, const unsigned char letter, uint8_t bGraphicsMode);
     int charWidth(const unsigned char letter);
+    // Szerokość napisu tak jak rysuje go drawString (bez odstępu za ostatnim znakiem)
+    int stringWidth(const char* bChars, unsigned int length);
+
+    // Układ tekstu bieżącym fontem w prostokącie (x, y, width, height) - flagi DMD_TEXT_*.
+    // Wiersze co FONT_HEIGHT + 1 pikseli; wszystko poza prostokątem jest obcinane.
+    // Blok jest rysowany w całości (w GRAPHICS_NORMAL także odstępy między znakami
+    // i wierszami). false gdy font nie ma atlasu lub zabrakło pamięci.
+    bool layoutText(DMDTextLayout &layout, int x, int y, int width, int height,
+                    const char* text, unsigned int length, uint8_t flags);
+    void drawLayout(const DMDTextLayout &layout, uint8_t bGraphicsMode);
+    // layoutText() tylko gdy tekst, font, prostokąt lub flagi są inne niż w layout, potem drawLayout()
+    void drawText(DMDTextLayout &layout, int x, int y, int width, int height,
+                  const char* text, unsigned int length, uint8_t flags, uint8_t bGraphicsMode);
 
-    // Efekty przewijania
-    void drawMarquee(const char* bChars, uint8_t length, int left, int top);
+    // Efekty przewijania. Tekst (dowolnej długości) jest renderowany raz bieżącym fontem
+    // do paska; każdy krok rysuje cały prostokąt: okno paska w nowym położeniu, reszta
+    // zgaszona. left/top: położenie tekstu względem prostokąta (domyślnie cały ekran).
+    // Tekst, który cały wyjdzie z prostokąta, wchodzi z przeciwnej strony, zaczynając tuż
+    // za krawędzią (stepMarquee zwraca wtedy true); przy krokach > 1 piksel położenie
+    // zawija się modulo, bez zatrzymania na krawędzi. Przy gap >= 0 powtarza się
+    // w poziomie bez przerwy, co szerokość tekstu + gap pikseli. drawMarquee/stepMarquee
+    // działają na obszarze 0.
+    void drawMarquee(const char* bChars, unsigned int length, int left, int top);
+    void drawMarquee(const char* bChars, unsigned int length, int left, int top,
+                     int x, int y, int width, int height, int gap = -1);
     bool stepMarquee(int amountX, int amountY);
+    // Kilka niezależnych obszarów (index < DMD_MAX_MARQUEES), każdy z tekstem w bieżącym
+    // foncie, własnym prostokątem i prędkością. Rysowanie nie wychodzi poza prostokąt
+    // obszaru; nakładające się obszary są rysowane po kolei (wyższy index na wierzchu).
+    // false gdy index jest poza zakresem lub tekstu nie udało się ułożyć.
+    bool setMarquee(uint8_t index, const char* bChars, unsigned int length, int left, int top,
+                    int x, int y, int width, int height, int speedX, int speedY, int gap = -1);
+    void setMarqueeSpeed(uint8_t index, int speedX, int speedY);
+    // Wyłącza obszar; clear = zgasić jego prostokąt
+    void removeMarquee(uint8_t index, bool clear = true);
+    // Jeden krok wszystkich obszarów o ich prędkość; przerysowuje tylko te, które się
+    // przesunęły. Bit i wyniku = obszar i wszedł ponownie z przeciwnej strony.
+    uint32_t stepMarquees();
+
+    // Warstwy (index < DMD_MAX_LAYERS), np. tło, tekst, nakładka, sprite'y. compose()
+    // składa widoczne warstwy od najmniejszego z (przy równych od mniejszego index) na
+    // zgaszonym tle, każdą jej trybem: NORMAL/INVERSE zakrywają cały prostokąt warstwy,
+    // TOGGLE/OR/NOR zmieniają tylko piksele zapalone w warstwie. Wynik trafia na ekran
+    // tylko w prostokątach zmienionych od poprzedniego compose() - poza nimi zostaje to,
+    // co narysowały zwykłe funkcje. Przy podwójnym buforowaniu wymaga copyOnFlip.
+    // Nowa warstwa jest pusta, widoczna, w (0, 0); false gdy zabrakło pamięci.
+    bool setLayer(uint8_t index, int width, int height, uint8_t bGraphicsMode, int z = 0);
+    void removeLayer(uint8_t index);
+    void moveLayer(uint8_t index, int x, int y);
+    void showLayer(uint8_t index, bool visible);
+    void setLayerMode(uint8_t index, uint8_t bGraphicsMode);
+    void setLayerZ(uint8_t index, int z);
+    // Rysowanie w warstwie: współrzędne warstwy, przycięte do niej, tryby jak w blit()
+    void layerBlit(uint8_t index, int x, int y, const uint8_t *bitmap, unsigned int stride, int width, int height,
+                   uint8_t bGraphicsMode, int srcX = 0);
+    void layerDrawLayout(uint8_t index, const DMDTextLayout &layout, uint8_t bGraphicsMode);
+    void clearLayer(uint8_t index);
+    // Składa zmienione prostokąty na ekran (wszystkie bitplany, pełna jasność)
+    void compose();
+
+    // Bitmapa 1 bit/piksel (bit 7 pierwszego bajtu = lewy piksel, 1 = zapalony), wiersze
+    // co stride bajtów, od kolumny srcX; kopiowany prostokąt width x height trafia na (x, y),
+    // przycięty do ekranu
+    void blit(int x, int y, const uint8_t *bitmap, unsigned int stride, int width, int height,
+              uint8_t bGraphicsMode, int srcX = 0);
 
     // Kształty
     void drawLine(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode);
@@ -104,35 +413,263 @@ public:
     void drawFilledBox(int x1, int y1, int x2, int y2, uint8_t bGraphicsMode);
     void drawTestPattern(uint8_t bPattern);
 
-    // Aktualizacja
+    // Ułożenie paneli: panels[k] mówi, którą część ściany pokazuje k-ty panel łańcucha.
+    // Rysowanie zostaje we współrzędnych ściany, a mapowanie robi tablica budowana tutaj
+    // i używana przy składaniu faz (jeden odczyt tablicy na bajt). Wywoływać przed
+    // startRefresh(); false gdy wpis wychodzi poza ścianę.
+    bool setTopology(const DMDPanelPlacement *panels);
+    // Łańcuch wężykiem: nieparzyste wiersze paneli od prawej do lewej, obrócone o 180°
+    void setSerpentineTopology();
+
+    // Podział ściany na łańcuchy, każdy na własnej magistrali SPI i własnych liniach
+    // A/B/SCLK/nOE (backend). Łańcuch c dostaje panels[c] kolejnych pozycji łańcucha
+    // (w kolejności z setTopology); backends[0] == NULL zostawia wyjście z konstruktora.
+    // Backendy są otwierane tutaj i zostają własnością wywołującego. Wątek odświeżania
+    // skanuje wtedy każdy łańcuch z osobnego wątku, wszystkie w tej samej fazie.
+    // Wywoływać przed startRefresh(); false przy złym podziale lub błędzie open().
+    bool setChains(int count, DMDBackend **backends, const uint16_t *panels);
+    int getChainCount() const { return bChains; }
+
+    // Aktualizacja (przy kilku łańcuchach wysyła je po kolei)
     void scanDisplayBySPI();
+    // Tempo, w jakim wywołujący skanuje (pełne ramki na sekundę; 0 = domyślne) - od niego
+    // zależy okno świecenia przy jasności < max i odcieniach szarości. startRefresh()
+    // ustawia je samo; nie zmieniać, gdy wątek odświeżania działa.
+    void setRefreshRate(unsigned int framesPerSecond);
 
-private:
-    void drawCircleSub(int cx, int cy, int x, int y, uint8_t bGraphicsMode);
+    // Wątek odświeżania: skanuje panele w stałym tempie (framesPerSecond pełnych ramek),
+    // opcjonalnie z priorytetem SCHED_FIFO (priority > 0), przypięty do rdzenia (cpu >= 0,
+    // kolejne łańcuchy na kolejnych rdzeniach) i z zablokowaną pamięcią procesu (mlockall).
+    // false gdy wyjście nie jest otwarte (isOpen) lub wątku nie udało się utworzyć.
+    bool startRefresh(unsigned int framesPerSecond = DMD_DEFAULT_REFRESH_HZ, int priority = 0,
+                      int cpu = -1, bool lockMemory = false);
+    void stopRefresh();
+    bool isRefreshing() const { return bRefreshRunning.load(std::memory_order_acquire); }
+
+    // Podwójne buforowanie: rysowanie idzie do bufora tylnego, skanowanie czyta przedni.
+    // swapBuffers() publikuje gotową ramkę (atFrameStart: dopiero od najbliższej fazy 0).
+    // copyOnFlip kopiuje nową ramkę do bufora tylnego, żeby rysować przyrostowo;
+    // bez niego bufory są niezależne.
+    // copyOnFlip ustala pierwsze wywołanie.
+    // atFrameStart działa tylko z wątkiem odświeżania (startRefresh). Gdy skanuje
+    // wywołujący, bufory są przełączane od razu - żeby zmiana wypadła na granicy ramki,
+    // trzeba wywołać swapBuffers() po czwartym scanDisplayBySPI() ramki.
+    void enableDoubleBuffering(bool copyOnFlip = true);
+    void swapBuffers(bool atFrameStart = false);
+
+    // Jasność całej ściany (0..DMD_MAX_BRIGHTNESS) - część fazy z włączonym nOE.
+    // Można zmieniać w trakcie skanowania. Przy jasności < max scanDisplayBySPI()
+    // czeka do końca okna świecenia, więc wywołujący powinien skanować ze stałym tempem
+    // (setRefreshRate). Przy jasności 0 faza jest zatrzaskiwana bez włączania nOE.
+    void setBrightness(uint8_t level) { bBrightness = level; }
+    uint8_t getBrightness() const { return bBrightness; }
+
+    // Fazy złożone na nowo / wysłane z pamięci podręcznej (tylko DMD_LAYOUT_ROWS).
+    // Składane są tylko fazy paneli zmienionych od ostatniego wysłania.
+    uint64_t getPackedPhaseCount() const { return ulPhasesPacked.load(std::memory_order_relaxed); }
+    uint64_t getReusedPhaseCount() const { return ulPhasesReused.load(std::memory_order_relaxed); }
+
+    // Rzeczywista liczba pełnych ramek na sekundę (uaktualniana co sekundę)
+    float getFramesPerSecond() const { return fFramesPerSecond; }
 
-    // Bufor RAM dla ekranu
+    // Statystyki skanowania (DMDStats.h), do odczytu z dowolnego wątku
+    const DMDStats& getStats() const { return stats; }
+    void resetStats() { stats.reset(); }
+    void printStats(FILE *out = stdout);
+
+protected:
+    // Pamięć na bufory podana z zewnątrz (DMDFixed) - bez malloc, nie zwalniana w destruktorze.
+    // Rozmiary jak przy alokacji w konstruktorze; bufory [1] są używane po enableDoubleBuffering().
+    struct Storage {
+        uint8_t *screen[2];         // uiPlaneBytes * DMD_MAX_BITPLANES
+        uint8_t *spiBuffer[2];      // (DisplaysTotal << 4) * 4 * DMD_MAX_BITPLANES
+        uint8_t *stalePanels[2];    // DisplaysTotal
+        uint8_t *dirtyPanels;       // DisplaysTotal
+        uint8_t *dirtyPublished;    // DisplaysTotal
+        unsigned int *rowOffset;    // DMD_PIXELS_DOWN * panelsHigh
+        unsigned int *packMap;      // 4 * (DisplaysTotal << 4)
+        DMDPanelSlot *panelSlots;   // DisplaysTotal
+    };
+    DMD(uint16_t panelsWide, uint16_t panelsHigh, uint8_t layout, DMDBackend *backend, const Storage &storage);
+
+    // Zmiana jednego bitu piksela w trybie bGraphicsMode (wspólne dla writePixel i DMDFixed)
+    static inline void applyPixel(uint8_t *pixel, uint8_t lookup, uint8_t bGraphicsMode, uint8_t bPixel) {
+        DMD_WITH_OP(bGraphicsMode, dmdRasterOp<Op>(pixel, lookup, bPixel));
+    }
+
+    // Zaznacza fazy panelu w bDirtyPanels - zawsze po zmianie pikseli, których dotyczą.
+    // Przy jednym buforze i wątku odświeżania (bSharedMarks) wątek zabiera znaczniki
+    // w trakcie rysowania (wymiana z acquire w publishDirty); or z release gwarantuje,
+    // że kto zabierze znacznik, widzi też zapisane przed nim piksele. W pozostałych
+    // przypadkach nikt nie czyta znaczników równolegle i wystarcza zwykły zapis.
+    inline void markDirty(uint8_t *mark, uint8_t phases) {
+        if (bSharedMarks) __atomic_fetch_or(mark, phases, __ATOMIC_RELEASE);
+        else *mark |= phases;
+    }
+    void markAllDirty();
+
+    // Bufor RAM dla ekranu (bufor, do którego się rysuje)
     uint8_t *bDMDScreenRAM;
 
-    // Czcionka
+    // Zmienione fazy paneli od ostatniego przekazania (bity 0..3)
+    uint8_t *bDirtyPanels;
+    // Znaczniki zabierane przez wątek odświeżania w trakcie rysowania (startRefresh bez
+    // podwójnego buforowania); zmieniane tylko przez wątek rysujący
+    bool bSharedMarks;
+
+    // Bitplany odcieni szarości, każdy po uiPlaneBytes bajtów
+    uint8_t bBitplanes;
+    unsigned int uiPlaneBytes;
+
+private:
+    void init(uint16_t panelsWide, uint16_t panelsHigh, uint8_t layout, DMDBackend *backend, const Storage *storage);
+    // Wersje dla jednego trybu (Op = DMDOp*), wybierane przez DMD_WITH_OP
+    template <class Op> void plotPixel(unsigned int bX, unsigned int bY, uint8_t bPixel);
+    template <class Op> void writePixelsOp(const int *xs, const int *ys, unsigned int count, uint8_t bPixel);
+    template <class Op> void drawLineOp(int x1, int y1, int x2, int y2);
+    template <class Op> void drawCircleOp(int xCenter, int yCenter, int radius);
+    template <class Op> void drawCircleSub(int cx, int cy, int x, int y);
+    template <class Op> void blitOp(int x, int y, const uint8_t *bitmap, unsigned int stride, int width, int height, int srcX);
+    DMDFontAtlas* fontAtlas(const uint8_t *font);
+    bool atlasInUse(const DMDFontAtlas *atlas) const;
+    bool findGlyph(uint32_t codePoint, DMDFontAtlas *&atlas, unsigned int &glyph);
+    int codePointWidth(uint32_t codePoint);
+    int drawCodePoint(int bX, int bY, uint32_t codePoint, uint8_t bGraphicsMode);
+    unsigned int textLineEnd(const char *text, unsigned int length, unsigned int &start, int width, bool wrap,
+                             unsigned int &next);
+    template <class Op> void drawCharGlyph(int bX, int bY, const uint8_t *glyph, uint8_t width, uint8_t height, uint8_t bytes);
+    // Poziomy odcinek x1..x2 linii y: maski na brzegach, w środku całe bajty/słowa
+    void fillSpan(int x1, int x2, int y, uint8_t bGraphicsMode, uint8_t bPixel);
+    // Gasi prostokąt [x1, x2) x [y1, y2)
+    void clearRect(int x1, int y1, int x2, int y2);
+    bool moveMarquee(DMDMarquee &m, int amountX, int amountY);
+    void drawMarqueeWindow(const DMDMarquee &m);
+    void sortLayers();
+    void markLayer(const DMDLayer &layer);
+    void markRect(int x1, int y1, int x2, int y2);
+    void composeRect(const DMDRect &rect);
+    static void* refreshThreadEntry(void *arg);
+    static void* chainThreadEntry(void *arg);
+    void refreshLoop();
+    void chainLoop(int chain);
+    void configureThread(int cpu);
+    const uint8_t* beginPhase();
+    void outputPhase(int chain, const uint8_t *screen);
+    void endPhase();
+    void preparePhase(const uint8_t *screen, uint8_t phase);
+    const uint8_t* phaseData(const uint8_t *screen, uint8_t plane, uint8_t phase);
+    void sendPhase(DMDBackend *out, const uint8_t *data, int length);
+    void latchPhase(DMDBackend *out, uint8_t phase, bool light = true);
+    void publishDirty(int buffer);
+    void markStale(uint8_t *stale, const uint8_t *marks);
+    int bufferIndex(const uint8_t *screen) const { return screen == bScreenBuffers[0] ? 0 : 1; }
+    void copyPhases(uint8_t *dest, const uint8_t *src, uint8_t phases);
+    void buildPackMap(const DMDPanelPlacement *panels);
+
+    // Bufor skanowany i ramka czekająca na przełączenie przez wątek skanujący
+    uint8_t *bScreenBuffers[2];
+    std::atomic<uint8_t*> pFrontRAM;
+    std::atomic<uint8_t*> pPendingRAM;
+    bool bDoubleBuffered;
+    bool bCopyOnFlip;
+    bool bFlipAtFrameStart;
+
+    // Adres pierwszego bajtu każdej linii ekranu i odstęp (1 << bColShift)
+    // między kolejnymi bajtami linii - zależne od układu bufora
+    unsigned int *uiRowOffset;
+    uint8_t bLayout;
+    uint8_t bColShift;
+
+    // Źródło każdego bajtu fazy na SPI: offset w bitplanie (DMD_PACK_REVERSE = odwrócić
+    // bity), po row1 wpisów na fazę, oraz panel ściany dla każdej pozycji łańcucha.
+    // Przy domyślnym ułożeniu i DMD_LAYOUT_WIRE fazy idą prosto z bufora ekranu.
+    unsigned int *uiPackMap;
+    DMDPanelSlot *pPanelSlots;
+    bool bPackPhases;
+
+    // Złożone fazy wszystkich bitplanów w kolejności wysyłania (row3/row2/row1/row0
+    // dla każdego bajtu), osobno dla każdego bufora ekranu, ponownie używane dopóki
+    // faza panelu się nie zmieni
+    uint8_t *bSPIBuffer[2];
+
+    // Zmienione fazy paneli ściany przekazane ostatnim przełączeniem buforów oraz fazy
+    // łańcucha czekające na złożenie w bSPIBuffer danego bufora (po pozycji w łańcuchu)
+    uint8_t *bDirtyPublished;
+    uint8_t *bStalePanels[2];
+    std::atomic<uint64_t> ulPhasesPacked;
+    std::atomic<uint64_t> ulPhasesReused;
+
+    // Czcionka i jej atlas (NULL = glify dekodowane wprost z fontu)
     const uint8_t* Font;
+    DMDFontAtlas *pFontAtlas;
+    DMDFontAtlas fontAtlases[DMD_FONT_CACHE];
+    uint8_t bNextAtlas;
+    const uint8_t *pFallbackFonts[DMD_MAX_FALLBACK_FONTS];
+    DMDFontAtlas *pFallbackAtlas[DMD_MAX_FALLBACK_FONTS];
+    uint8_t bFallbackFonts;
 
-    // Tekst przewijany
-    char marqueeText[256];
-    uint8_t marqueeLength;
-    int marqueeWidth;
-    int marqueeHeight;
-    int marqueeOffsetX;
-    int marqueeOffsetY;
+    // Obszary przewijania
+    DMDMarquee marquees[DMD_MAX_MARQUEES];
+
+    // Warstwy, ich indeksy w kolejności składania i prostokąty do złożenia
+    DMDLayer layers[DMD_MAX_LAYERS];
+    uint8_t bLayerOrder[DMD_MAX_LAYERS];
+    uint8_t bLayerCount;
+    DMDRect composeRects[DMD_MAX_DIRTY_RECTS];
+    uint8_t bComposeRects;
 
     // Informacje o wyświetlaczu
-    uint8_t DisplaysWide;
-    uint8_t DisplaysHigh;
-    uint8_t DisplaysTotal;
+    uint16_t DisplaysWide;
+    uint16_t DisplaysHigh;
+    uint16_t DisplaysTotal;
     volatile uint8_t bDMDByte;
+    int row1;
+    int row2;
+    int row3;
+
+    // Wątek odświeżania
+    // Zapisywane przez startRefresh/stopRefresh, czytane w pętli wątku i w swapBuffers
+    pthread_t refreshThread;
+    std::atomic<bool> bRefreshRunning;
+    unsigned int uiRefreshRate;
+    int iRefreshPriority;
+    int iRefreshCpu;
+
+    // Łańcuchy: wyjście, pierwsza pozycja i liczba paneli. Wątek odświeżania składa fazę,
+    // podbija uiChainGeneration i sam wysyła łańcuch 0; wątki pozostałych łańcuchów
+    // wysyłają swoje części i zgłaszają koniec przez iChainsPending.
+    DMDBackend *pChainOutput[DMD_MAX_CHAINS];
+    uint16_t uiChainFirst[DMD_MAX_CHAINS];
+    uint16_t uiChainPanels[DMD_MAX_CHAINS];
+    uint8_t bChains;
+    pthread_t chainThreads[DMD_MAX_CHAINS];
+    struct ChainThreadArg { DMD *dmd; int chain; } chainArgs[DMD_MAX_CHAINS];
+    int iChainThreads;
+    pthread_mutex_t chainMutex;
+    pthread_cond_t chainStart;
+    pthread_cond_t chainDone;
+    unsigned int uiChainGeneration;
+    int iChainsPending;
+    const uint8_t *pChainScreen;
+    bool bChainsStop;
+
+    // Jasność (czas świecenia w fazie)
+    volatile uint8_t bBrightness;
+
+    // Pomiar liczby ramek na sekundę i statystyki skanowania
+    DMDStats stats;
+    uint64_t ulPhaseStartNs;
+    volatile float fFramesPerSecond;
+    unsigned int uiFrameCount;
+    uint64_t ulFpsWindowStart;
+
+    // Wyjście SPI/GPIO
+    DMDBackend *pOutput;
+    bool bOwnsOutput;
+    bool bOutputOpen;
 
-    // Handlery lgpio
-    int hChip;
-    int hSpi;
+    // Bufory z Storage (nie zwalniane)
+    bool bStaticStorage;
 };
 
 #endif /* DMD_H_ */
\ No newline at end of file
@@ -0,0 +1,279 @@
+/*--------------------------------------------------------------------------------------
+
+ DMDBackend.cpp - Output backends for the DMD library: lgpio, raw spidev + gpiochip
+                  character device, and an in-memory mock for running off a Pi.
+
+--------------------------------------------------------------------------------------*/
+#include "DMDBackend.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+
+static const DMDPins defaultPins = { PIN_DMD_A, PIN_DMD_B, PIN_DMD_SCLK, PIN_DMD_nOE };
+
+static inline uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifndef DMD_NO_LGPIO
+/*--------------------------------------------------------------------------------------
+ lgpio backend
+
+ A, B, SCLK and nOE are claimed as one group (leader: the A pin), in the bit order of
+ DMD_GROUP_*, so every control update is a single lgGroupWrite.
+--------------------------------------------------------------------------------------*/
+DMDLgpioBackend::DMDLgpioBackend(int gpioChip, int spiBus, int spiChip, int spiSpeed, const DMDPins *pins) {
+    this->pins = pins ? *pins : defaultPins;
+    iGpioChip = gpioChip;
+    iSpiBus = spiBus;
+    iSpiChip = spiChip;
+    iSpiSpeed = spiSpeed;
+    hChip = -1;
+    hSpi = -1;
+    bReportedError = false;
+}
+
+DMDLgpioBackend::~DMDLgpioBackend() {
+    if (hSpi >= 0) lgSpiClose(hSpi);
+    if (hChip >= 0) lgGpiochipClose(hChip);
+}
+
+bool DMDLgpioBackend::open() {
+    // Opened again after a failed attempt (DMD::begin): drop what that attempt got
+    if (hSpi >= 0) { lgSpiClose(hSpi); hSpi = -1; }
+    if (hChip >= 0) { lgGpiochipClose(hChip); hChip = -1; }
+
+    hChip = lgGpiochipOpen(iGpioChip);
+    if (hChip < 0) { perror("lgGpiochipOpen"); return false; }
+
+    const int groupPins[4] = { pins.a, pins.b, pins.sclk, pins.nOE };
+    static const int groupLevels[4] = { 0, 0, 0, 0 };
+    if (lgGroupClaimOutput(hChip, 0, 4, groupPins, groupLevels) < 0) { perror("lgGroupClaimOutput"); return false; }
+    if (iSpiBus == 0) {
+        lgGpioClaimOutput(hChip, 0, PIN_DMD_CLK, 0);
+        lgGpioClaimOutput(hChip, 0, PIN_DMD_R_DATA, 1);
+    }
+
+    hSpi = lgSpiOpen(iSpiBus, iSpiChip, iSpiSpeed, 0);
+    if (hSpi < 0) { perror("lgSpiOpen"); return false; }
+    return true;
+}
+
+bool DMDLgpioBackend::writeSPI(const uint8_t *data, int length) {
+    while (length > 0) {
+        int chunk = length > DMD_SPI_MAX_TRANSFER ? DMD_SPI_MAX_TRANSFER : length;
+        int err = lgSpiWrite(hSpi, (const char*)data, chunk);
+        if (err < 0) {
+            if (!bReportedError) fprintf(stderr, "lgSpiWrite: %d\n", err);
+            bReportedError = true;
+            return false;
+        }
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+void DMDLgpioBackend::writeControl(uint8_t bits, uint8_t mask) {
+    lgGroupWrite(hChip, pins.a, bits, mask);
+}
+
+// Only SPI0 is shared with another device (PIN_OTHER_SPI_nCS)
+bool DMDLgpioBackend::spiAvailable() {
+    if (iSpiBus != 0) return true;
+    return lgGpioRead(hChip, PIN_OTHER_SPI_nCS) == 1;
+}
+#endif
+
+/*--------------------------------------------------------------------------------------
+ spidev backend
+
+ SPI goes straight to /dev/spidev*, the control lines are requested from the gpiochip
+ character device as one GPIO v2 line request, so the kernel sets all of them in a
+ single GPIO_V2_LINE_SET_VALUES_IOCTL.
+
+ Transfers use SPI_IOC_MESSAGE(n) with a segment table allocated once at open(). The
+ kernel bounds the whole message by the spidev bounce buffer (bufsiz, each segment
+ rounded up to the kmalloc alignment), so as many segments as fit go into one ioctl.
+ Raising spidev.bufsiz lets a whole phase of a long chain go out in one call.
+--------------------------------------------------------------------------------------*/
+#define SPIDEV_BUFSIZ_PARAM  "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_SEGMENT_ALIGN 128
+
+static unsigned int readSpidevBufSize() {
+    unsigned int bufsiz = 0;
+    FILE *f = fopen(SPIDEV_BUFSIZ_PARAM, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%u", &bufsiz) != 1) bufsiz = 0;
+        fclose(f);
+    }
+    return bufsiz ? bufsiz : DMD_SPI_MAX_TRANSFER;
+}
+
+DMDSpidevBackend::DMDSpidevBackend(const char *spiDevice, const char *gpioChip, unsigned int spiSpeed,
+                                   const DMDPins *pins) {
+    this->pins = pins ? *pins : defaultPins;
+    this->spiDevice = spiDevice;
+    this->gpioChip = gpioChip;
+    uiSpiSpeed = spiSpeed;
+    fdSpi = -1;
+    fdLines = -1;
+    uiBufSize = DMD_SPI_MAX_TRANSFER;
+    pXfers = NULL;
+    bReportedError = false;
+}
+
+DMDSpidevBackend::~DMDSpidevBackend() {
+    if (fdLines >= 0) close(fdLines);
+    if (fdSpi >= 0) close(fdSpi);
+    free(pXfers);
+}
+
+bool DMDSpidevBackend::open() {
+    // Opened again after a failed attempt (DMD::begin): drop what that attempt got
+    if (fdLines >= 0) { close(fdLines); fdLines = -1; }
+    if (fdSpi >= 0) { close(fdSpi); fdSpi = -1; }
+
+    fdSpi = ::open(spiDevice, O_RDWR);
+    if (fdSpi < 0) { perror(spiDevice); return false; }
+
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    if (ioctl(fdSpi, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(fdSpi, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(fdSpi, SPI_IOC_WR_MAX_SPEED_HZ, &uiSpiSpeed) < 0) { perror("spidev setup"); return false; }
+
+    uiBufSize = readSpidevBufSize();
+    free(pXfers);
+    pXfers = (struct spi_ioc_transfer*) calloc(DMD_SPIDEV_MAX_SEGMENTS, sizeof(struct spi_ioc_transfer));
+    if (pXfers == NULL) { perror("spidev transfers"); return false; }
+    for (int i = 0; i < DMD_SPIDEV_MAX_SEGMENTS; i++) {
+        pXfers[i].speed_hz = uiSpiSpeed;
+        pXfers[i].bits_per_word = 8;
+    }
+
+    int fdChip = ::open(gpioChip, O_RDWR);
+    if (fdChip < 0) { perror(gpioChip); return false; }
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = pins.a;
+    req.offsets[1] = pins.b;
+    req.offsets[2] = pins.sclk;
+    req.offsets[3] = pins.nOE;
+    req.num_lines = 4;
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    strncpy(req.consumer, "DMD", sizeof(req.consumer) - 1);
+    int res = ioctl(fdChip, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(fdChip);
+    if (res < 0) { perror("GPIO_V2_GET_LINE_IOCTL"); return false; }
+    fdLines = req.fd;
+    return true;
+}
+
+bool DMDSpidevBackend::writeSPI(const uint8_t *data, int length) {
+    unsigned int segmentMax = uiBufSize < DMD_SPIDEV_SEGMENT_MAX ? uiBufSize : DMD_SPIDEV_SEGMENT_MAX;
+    while (length > 0) {
+        int count = 0;
+        unsigned int total = 0;
+        while (length > 0 && count < DMD_SPIDEV_MAX_SEGMENTS) {
+            unsigned int segment = (unsigned int)length < segmentMax ? (unsigned int)length : segmentMax;
+            unsigned int aligned = (segment + SPIDEV_SEGMENT_ALIGN - 1) & ~(SPIDEV_SEGMENT_ALIGN - 1);
+            if (count > 0 && total + aligned > uiBufSize) break;
+            pXfers[count].tx_buf = (uintptr_t)data;
+            pXfers[count].len = segment;
+            count++;
+            total += aligned;
+            data += segment;
+            length -= segment;
+        }
+        if (ioctl(fdSpi, SPI_IOC_MESSAGE(count), pXfers) < 0) {
+            if (!bReportedError) perror("SPI_IOC_MESSAGE");
+            bReportedError = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+void DMDSpidevBackend::writeControl(uint8_t bits, uint8_t mask) {
+    struct gpio_v2_line_values values;
+    values.bits = bits;
+    values.mask = mask;
+    ioctl(fdLines, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+/*--------------------------------------------------------------------------------------
+ Mock backend
+--------------------------------------------------------------------------------------*/
+DMDMockBackend::DMDMockBackend(bool record) {
+    bRecord = record;
+    bLines = 0;
+    totalSpiBytes = 0;
+    totalSpiTransfers = 0;
+    totalControlWrites = 0;
+    bSpiBytes = NULL;
+    uiSpiBytes = uiSpiBytesCap = 0;
+    pTransfers = NULL;
+    uiTransfers = uiTransfersCap = 0;
+    pEdges = NULL;
+    uiEdges = uiEdgesCap = 0;
+}
+
+DMDMockBackend::~DMDMockBackend() {
+    free(bSpiBytes);
+    free(pTransfers);
+    free(pEdges);
+}
+
+void DMDMockBackend::clear() {
+    uiSpiBytes = 0;
+    uiTransfers = 0;
+    uiEdges = 0;
+}
+
+bool DMDMockBackend::writeSPI(const uint8_t *data, int length) {
+    totalSpiBytes += length;
+    totalSpiTransfers++;
+    if (!bRecord) return true;
+
+    if (uiSpiBytes + length > uiSpiBytesCap) {
+        while (uiSpiBytes + length > uiSpiBytesCap) uiSpiBytesCap = uiSpiBytesCap ? uiSpiBytesCap * 2 : 4096;
+        bSpiBytes = (uint8_t*) realloc(bSpiBytes, uiSpiBytesCap);
+    }
+    if (uiTransfers == uiTransfersCap) {
+        uiTransfersCap = uiTransfersCap ? uiTransfersCap * 2 : 256;
+        pTransfers = (DMDMockTransfer*) realloc(pTransfers, uiTransfersCap * sizeof(DMDMockTransfer));
+    }
+    pTransfers[uiTransfers].timestampNs = monotonicNs();
+    pTransfers[uiTransfers].offset = uiSpiBytes;
+    pTransfers[uiTransfers].length = length;
+    uiTransfers++;
+    memcpy(bSpiBytes + uiSpiBytes, data, length);
+    uiSpiBytes += length;
+    return true;
+}
+
+void DMDMockBackend::writeControl(uint8_t bits, uint8_t mask) {
+    totalControlWrites++;
+    uint8_t lines = (bLines & ~mask) | (bits & mask);
+    if (lines == bLines) return;
+    bLines = lines;
+    if (!bRecord) return;
+
+    if (uiEdges == uiEdgesCap) {
+        uiEdgesCap = uiEdgesCap ? uiEdgesCap * 2 : 256;
+        pEdges = (DMDMockEdge*) realloc(pEdges, uiEdgesCap * sizeof(DMDMockEdge));
+    }
+    pEdges[uiEdges].timestampNs = monotonicNs();
+    pEdges[uiEdges].lines = lines;
+    uiEdges++;
+}
@@ -0,0 +1,157 @@
+#ifndef DMD_BACKEND_H_
+#define DMD_BACKEND_H_
+
+#include "DMD.h"
+
+#ifndef DMD_NO_LGPIO
+#include <lgpio.h>
+#endif
+
+// ============================================================================
+// Interfejs wyjścia: SPI do łańcucha paneli + linie sterujące A/B/SCLK/nOE
+// ============================================================================
+// Linie sterujące są adresowane bitami DMD_GROUP_* i zawsze zmieniane razem
+// (jeden zapis = jedna zmiana stanu grupy).
+// Linie sterujące łańcucha (numery BCM); NULL w konstruktorach = PIN_DMD_*.
+// Dodatkowe łańcuchy (DMD::setChains) potrzebują własnych linii.
+struct DMDPins {
+    int a;
+    int b;
+    int sclk;
+    int nOE;
+};
+
+class DMDBackend {
+public:
+    virtual ~DMDBackend() {}
+
+    // Otwiera urządzenia; false gdy się nie udało (przyczyna wypisana przez perror)
+    virtual bool open() = 0;
+
+    // Wysyła dane do łańcucha paneli, dzieląc na kawałki gdy trzeba; false gdy transfer
+    // się nie udał (reszta danych nie jest wysyłana, przyczyna wypisana przy pierwszym błędzie)
+    virtual bool writeSPI(const uint8_t *data, int length) = 0;
+
+    // Ustawia linie zaznaczone w mask na wartości z bits
+    virtual void writeControl(uint8_t bits, uint8_t mask) = 0;
+
+    // false gdy magistrala SPI jest zajęta przez inne urządzenie
+    virtual bool spiAvailable() { return true; }
+};
+
+#ifndef DMD_NO_LGPIO
+// ============================================================================
+// lgpio (domyślne)
+// ============================================================================
+class DMDLgpioBackend : public DMDBackend {
+public:
+    DMDLgpioBackend(int gpioChip = 0, int spiBus = SPI_BUS, int spiChip = SPI_CHIP, int spiSpeed = SPI_SPEED,
+                    const DMDPins *pins = NULL);
+    ~DMDLgpioBackend();
+
+    bool open();
+    bool writeSPI(const uint8_t *data, int length);
+    void writeControl(uint8_t bits, uint8_t mask);
+    bool spiAvailable();
+
+private:
+    int iGpioChip;
+    int iSpiBus;
+    int iSpiChip;
+    int iSpiSpeed;
+    DMDPins pins;
+
+    // Handlery lgpio
+    int hChip;
+    int hSpi;
+    bool bReportedError;
+};
+#endif
+
+// ============================================================================
+// Bezpośrednio /dev/spidev* + znakowe urządzenie /dev/gpiochip*
+// ============================================================================
+// Dane idą przez SPI_IOC_MESSAGE(n) z przygotowaną raz tablicą segmentów; jedno ioctl
+// niesie tyle segmentów, ile zmieści bufor spidev (parametr modułu bufsiz).
+#define DMD_SPIDEV_MAX_SEGMENTS  16
+#define DMD_SPIDEV_SEGMENT_MAX   65536
+
+struct spi_ioc_transfer;
+
+class DMDSpidevBackend : public DMDBackend {
+public:
+    DMDSpidevBackend(const char *spiDevice = "/dev/spidev0.0", const char *gpioChip = "/dev/gpiochip0",
+                     unsigned int spiSpeed = SPI_SPEED, const DMDPins *pins = NULL);
+    ~DMDSpidevBackend();
+
+    bool open();
+    bool writeSPI(const uint8_t *data, int length);
+    void writeControl(uint8_t bits, uint8_t mask);
+
+private:
+    const char *spiDevice;
+    const char *gpioChip;
+    unsigned int uiSpiSpeed;
+    DMDPins pins;
+
+    int fdSpi;
+    int fdLines;
+
+    unsigned int uiBufSize;
+    struct spi_ioc_transfer *pXfers;
+    bool bReportedError;
+};
+
+// ============================================================================
+// Atrapa: zapamiętuje bajty SPI i zmiany linii sterujących ze znacznikami czasu
+// ============================================================================
+struct DMDMockTransfer {
+    uint64_t timestampNs;
+    unsigned int offset;      // początek w spiBytes()
+    unsigned int length;
+};
+
+struct DMDMockEdge {
+    uint64_t timestampNs;
+    uint8_t lines;            // stan linii (bity DMD_GROUP_*) po zmianie
+};
+
+class DMDMockBackend : public DMDBackend {
+public:
+    // record = false: tylko liczniki, bez zapamiętywania danych (do benchmarków)
+    DMDMockBackend(bool record = true);
+    ~DMDMockBackend();
+
+    bool open() { return true; }
+    bool writeSPI(const uint8_t *data, int length);
+    void writeControl(uint8_t bits, uint8_t mask);
+
+    void setRecording(bool record) { bRecord = record; }
+    void clear();
+
+    const uint8_t* spiBytes() const { return bSpiBytes; }
+    unsigned int spiByteCount() const { return uiSpiBytes; }
+    const DMDMockTransfer* transfers() const { return pTransfers; }
+    unsigned int transferCount() const { return uiTransfers; }
+    const DMDMockEdge* edges() const { return pEdges; }
+    unsigned int edgeCount() const { return uiEdges; }
+    uint8_t controlLines() const { return bLines; }
+
+    // Liczniki od utworzenia (także gdy zapis jest wyłączony)
+    uint64_t totalSpiBytes;
+    uint64_t totalSpiTransfers;
+    uint64_t totalControlWrites;
+
+private:
+    bool bRecord;
+    uint8_t bLines;
+
+    uint8_t *bSpiBytes;
+    unsigned int uiSpiBytes, uiSpiBytesCap;
+    DMDMockTransfer *pTransfers;
+    unsigned int uiTransfers, uiTransfersCap;
+    DMDMockEdge *pEdges;
+    unsigned int uiEdges, uiEdgesCap;
+};
+
+#endif /* DMD_BACKEND_H_ */
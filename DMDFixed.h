@@ -0,0 +1,93 @@
+#ifndef DMD_FIXED_H_
+#define DMD_FIXED_H_
+
+#include "DMD.h"
+
+// ============================================================================
+// DMD o rozmiarze ściany znanym w czasie kompilacji
+// ============================================================================
+// Wszystkie bufory są częścią obiektu (bez malloc) - zadeklarowany globalnie lub
+// jako static leży w pamięci statycznej. writePixel()/writePixelIntensity() liczą
+// adres ze stałych, więc mnożenia i dzielenia przez rozmiar ściany kompilator
+// zamienia na przesunięcia i maski. Pozostałe funkcje rysujące i skanowanie
+// pochodzą z DMD; przy rozmiarze znanym dopiero w czasie działania używa się DMD.
+// Funkcje DMD nie są wirtualne: szybka ścieżka działa tylko przy wywołaniu na obiekcie
+// typu DMDFixed (lub przez DMDFixed& / DMDFixed*) - przez DMD& / DMD* i w pozostałych
+// funkcjach rysujących używany jest zwykły DMD::writePixel.
+//
+//   static DMDFixed<2, 1> dmd;
+template <uint16_t Wide, uint16_t High>
+struct DMDFixedStorage {
+    static const unsigned int Total = Wide * High;
+    static const unsigned int PlaneBytes = Total * DMD_RAM_SIZE_BYTES;
+
+    uint8_t screenRAM[2][PlaneBytes * DMD_MAX_BITPLANES];
+    uint8_t spiRAM[2][(Total << 4) * 4 * DMD_MAX_BITPLANES];
+    uint8_t stale[2][Total];
+    uint8_t dirty[Total];
+    uint8_t published[Total];
+    unsigned int rowOffset[DMD_PIXELS_DOWN * High];
+    unsigned int packMap[4 * (Total << 4)];
+    DMDPanelSlot panelSlots[Total];
+};
+
+template <uint16_t Wide, uint16_t High, uint8_t Layout = DMD_LAYOUT_ROWS>
+class DMDFixed : private DMDFixedStorage<Wide, High>, public DMD {
+    typedef DMDFixedStorage<Wide, High> Buffers;
+
+public:
+    static const unsigned int Width = DMD_PIXELS_ACROSS * Wide;
+    static const unsigned int Height = DMD_PIXELS_DOWN * High;
+
+    // Magazyn (klasa bazowa Buffers) powstaje przed DMD, więc konstruktor DMD może w nim pisać
+    DMDFixed(DMDBackend *backend = NULL) : DMD(Wide, High, Layout, backend, storage(this)) {}
+
+    void writePixel(unsigned int bX, unsigned int bY, uint8_t bGraphicsMode, uint8_t bPixel) {
+        if (bX >= Width || bY >= Height) return;
+        uint8_t *pixel = bDMDScreenRAM + address(bX, bY);
+        uint8_t lookup = 0x80 >> (bX & 7);
+        for (uint8_t plane = 0; plane < bBitplanes; plane++, pixel += Buffers::PlaneBytes)
+            applyPixel(pixel, lookup, bGraphicsMode, bPixel);
+        markDirty(bDirtyPanels + (bY >> 4) * Wide + (bX >> 5), 1 << (bY & 3));
+    }
+
+    void writePixelIntensity(unsigned int bX, unsigned int bY, uint8_t intensity) {
+        if (bX >= Width || bY >= Height) return;
+        uint8_t *pixel = bDMDScreenRAM + address(bX, bY);
+        uint8_t lookup = 0x80 >> (bX & 7);
+        for (uint8_t plane = 0; plane < bBitplanes; plane++, pixel += Buffers::PlaneBytes) {
+            if (intensity & (1 << plane)) *pixel &= ~lookup;
+            else *pixel |= lookup;
+        }
+        markDirty(bDirtyPanels + (bY >> 4) * Wide + (bX >> 5), 1 << (bY & 3));
+    }
+
+private:
+    // To samo co uiRowOffset[y] + ((x >> 3) << bColShift) w DMD, liczone ze stałych
+    static inline unsigned int address(unsigned int x, unsigned int y) {
+        unsigned int line = y & (DMD_PIXELS_DOWN - 1);
+        unsigned int panelRow = y / DMD_PIXELS_DOWN;
+        if (Layout == DMD_LAYOUT_WIRE)
+            return (line & 3) * (Buffers::Total << 4) + ((panelRow * Wide * 4) << 2)
+                   + (3 - (line >> 2)) + ((x >> 3) << 2);
+        return line * (Buffers::Total << 2) + panelRow * Wide * 4 + (x >> 3);
+    }
+
+    static Storage storage(Buffers *b) {
+        Storage s;
+        s.screen[0] = b->screenRAM[0];
+        s.screen[1] = b->screenRAM[1];
+        s.spiBuffer[0] = b->spiRAM[0];
+        s.spiBuffer[1] = b->spiRAM[1];
+        s.stalePanels[0] = b->stale[0];
+        s.stalePanels[1] = b->stale[1];
+        s.dirtyPanels = b->dirty;
+        s.dirtyPublished = b->published;
+        s.rowOffset = b->rowOffset;
+        s.packMap = b->packMap;
+        s.panelSlots = b->panelSlots;
+        return s;
+    }
+};
+
+#endif /* DMD_FIXED_H_ */
@@ -0,0 +1,88 @@
+#ifndef DMD_STATS_H_
+#define DMD_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+
+// ============================================================================
+// Statystyki odświeżania
+// ============================================================================
+// Zapisywane przez wątek skanujący, czytane z dowolnego wątku bez blokad
+// (atomiki z memory_order_relaxed). -DDMD_ENABLE_STATS=0 usuwa pomiary ze ścieżki
+// skanowania całkowicie.
+#ifndef DMD_ENABLE_STATS
+#define DMD_ENABLE_STATS 1
+#endif
+
+#if DMD_ENABLE_STATS
+#define DMD_STATS(x) x
+#else
+#define DMD_STATS(x)
+#endif
+
+// Histogram czasu fazy: przedział i = [2^i, 2^(i+1)) µs, ostatni zbiera resztę
+#define DMD_STATS_BUCKETS 16
+
+struct DMDStats {
+    std::atomic<uint64_t> phases;
+    std::atomic<uint64_t> missedDeadlines;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> spiErrors;          // nieudane backend->writeSPI
+    std::atomic<uint64_t> spiNs;              // czas w backend->writeSPI
+    std::atomic<uint64_t> gpioNs;             // czas zatrzasku / wyboru linii / nOE
+    std::atomic<uint64_t> phaseHistogram[4][DMD_STATS_BUCKETS];
+
+    // Odstępy między początkami kolejnych faz i ich odchyłka od okresu docelowego
+    std::atomic<uint64_t> intervalMinNs;
+    std::atomic<uint64_t> intervalMaxNs;
+    std::atomic<uint64_t> jitterSumNs;
+    std::atomic<uint64_t> jitterMaxNs;
+    std::atomic<uint64_t> intervals;
+
+    uint64_t lastPhaseStartNs;                // tylko wątek skanujący
+
+    DMDStats() { reset(); }
+
+    void reset() {
+        phases = 0;
+        missedDeadlines = 0;
+        bytesSent = 0;
+        spiErrors = 0;
+        spiNs = 0;
+        gpioNs = 0;
+        for (int p = 0; p < 4; p++)
+            for (int b = 0; b < DMD_STATS_BUCKETS; b++) phaseHistogram[p][b] = 0;
+        intervalMinNs = UINT64_MAX;
+        intervalMaxNs = 0;
+        jitterSumNs = 0;
+        jitterMaxNs = 0;
+        intervals = 0;
+        lastPhaseStartNs = 0;
+    }
+
+    static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void recordPhase(uint8_t phase, uint64_t startNs, uint64_t endNs, uint64_t periodNs) {
+        add(phases, 1);
+        uint64_t us = (endNs - startNs) / 1000;
+        int bucket = us ? 63 - __builtin_clzll(us) : 0;
+        if (bucket >= DMD_STATS_BUCKETS) bucket = DMD_STATS_BUCKETS - 1;
+        add(phaseHistogram[phase & 3][bucket], 1);
+
+        if (lastPhaseStartNs != 0) {
+            uint64_t interval = startNs - lastPhaseStartNs;
+            uint64_t jitter = interval > periodNs ? interval - periodNs : periodNs - interval;
+            if (interval < intervalMinNs.load(std::memory_order_relaxed)) intervalMinNs.store(interval, std::memory_order_relaxed);
+            if (interval > intervalMaxNs.load(std::memory_order_relaxed)) intervalMaxNs.store(interval, std::memory_order_relaxed);
+            if (jitter > jitterMaxNs.load(std::memory_order_relaxed)) jitterMaxNs.store(jitter, std::memory_order_relaxed);
+            add(jitterSumNs, jitter);
+            add(intervals, 1);
+        }
+        lastPhaseStartNs = startNs;
+    }
+};
+
+#endif /* DMD_STATS_H_ */
@@ -0,0 +1,295 @@
+/*--------------------------------------------------------------------------------------
+
+ dmd_bench.cpp - Benchmarks for the DMD drawing primitives and the scan path.
+
+ Runs against DMDMockBackend, so it needs no Pi and no lgpio:
+
+   g++ -O2 -DDMD_NO_LGPIO -I.. dmd_bench.cpp ../DMD.cpp ../DMDBackend.cpp -lpthread -o dmd_bench
+   ./dmd_bench [milliseconds per benchmark]
+
+ Every benchmark is repeated until it has run for the given time (default 200 ms) and
+ reported as nanoseconds per operation and pixels touched per second.
+
+--------------------------------------------------------------------------------------*/
+#include "DMD.h"
+#include "DMDFixed.h"
+#include "DMDBackend.h"
+#include "SystemFont5x7.h"
+#include "Arial14.h"
+#include "Arial_black_16.h"
+#include "Arial_Black_16_ISO_8859_1.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t minRunNs = 200000000ULL;
+
+struct BenchContext {
+    DMD *dmd;
+    int width;
+    int height;
+    int step;
+};
+
+typedef void (*BenchOp)(BenchContext &ctx);
+
+// Runs op in growing batches until minRunNs has passed; pixels = pixels touched per op
+static void run(const char *config, const char *layout, const char *name, BenchContext &ctx,
+                BenchOp op, double pixels) {
+    uint64_t iterations = 0;
+    uint64_t batch = 1;
+    uint64_t start = nowNs();
+    uint64_t elapsed = 0;
+    while (elapsed < minRunNs) {
+        for (uint64_t i = 0; i < batch; i++) {
+            op(ctx);
+            ctx.step++;
+        }
+        iterations += batch;
+        if (batch < (1u << 20)) batch <<= 1;
+        elapsed = nowNs() - start;
+    }
+    double nsPerOp = (double)elapsed / iterations;
+    printf("%-6s %-5s %-34s %12.1f %12.2f\n", config, layout, name, nsPerOp, pixels * 1000.0 / nsPerOp);
+}
+
+/*--------------------------------------------------------------------------------------
+ Operations
+--------------------------------------------------------------------------------------*/
+static void opWritePixel(BenchContext &c) {
+    c.dmd->writePixel((c.step * 7) % c.width, (c.step * 3) % c.height, GRAPHICS_TOGGLE, true);
+}
+
+#define BENCH_POINTS 256
+static int pointsX[BENCH_POINTS], pointsY[BENCH_POINTS];
+
+static void opWritePixels(BenchContext &c) {
+    c.dmd->writePixels(pointsX, pointsY, BENCH_POINTS, GRAPHICS_TOGGLE);
+}
+
+static uint8_t benchBitmap[64 * 16];   // 512 x 16 source, 1 bit per pixel
+
+static void opBlitIcon(BenchContext &c) {
+    c.dmd->blit(c.step % c.width - 3, 0, benchBitmap, 64, 32, 16, GRAPHICS_NORMAL, 5);
+}
+
+static void opBlitWide(BenchContext &c) {
+    c.dmd->blit((c.step & 7) - 4, 0, benchBitmap, 64, c.width < 500 ? c.width : 500, 16, GRAPHICS_TOGGLE, 3);
+}
+
+static void opDrawLine(BenchContext &c) {
+    c.dmd->drawLine(0, c.step % c.height, c.width - 1, c.height - 1 - c.step % c.height, GRAPHICS_TOGGLE);
+}
+
+static void opDrawHorizontalLine(BenchContext &c) {
+    c.dmd->drawLine(0, c.step % c.height, c.width - 1, c.step % c.height, GRAPHICS_TOGGLE);
+}
+
+static void opDrawCircle(BenchContext &c) {
+    c.dmd->drawCircle(c.width / 2, c.height / 2, c.height / 2 - 1, GRAPHICS_TOGGLE);
+}
+
+static void opDrawFilledBox(BenchContext &c) {
+    c.dmd->drawFilledBox(0, 0, c.width - 1, c.height - 1, GRAPHICS_TOGGLE);
+}
+
+static const char benchText[] = "The quick brown fox 12:34";
+
+static void opDrawString(BenchContext &c) {
+    c.dmd->drawString(c.step & 7, 0, benchText, sizeof(benchText) - 1, GRAPHICS_NORMAL);
+}
+
+static volatile int measuredWidth;
+
+static void opStringWidth(BenchContext &c) {
+    measuredWidth = c.dmd->stringWidth(benchText, sizeof(benchText) - 1);
+}
+
+static DMDTextLayout benchLayout;
+
+static void opDrawTextCached(BenchContext &c) {
+    c.dmd->drawText(benchLayout, 0, 0, c.width, c.height, benchText, sizeof(benchText) - 1,
+                    DMD_TEXT_WRAP | DMD_TEXT_CENTER | DMD_TEXT_MIDDLE, GRAPHICS_NORMAL);
+}
+
+static void opLayoutText(BenchContext &c) {
+    c.dmd->layoutText(benchLayout, 0, 0, c.width, c.height, benchText, sizeof(benchText) - 1,
+                      DMD_TEXT_WRAP | DMD_TEXT_CENTER | DMD_TEXT_MIDDLE);
+}
+
+static void opClearScreen(BenchContext &c) {
+    c.dmd->clearScreen(c.step & 1);
+}
+
+static int marqueeX, marqueeY;
+
+static void opStepMarquee(BenchContext &c) {
+    c.dmd->stepMarquee(marqueeX, marqueeY);
+}
+
+static void opStepMarquees(BenchContext &c) {
+    c.dmd->stepMarquees();
+}
+
+// Layer 1 is a 16x16 sprite moving over the full-screen background layer 0
+static uint8_t benchBackground[64 * 128];   // up to a 16x8 wall, 1 bit per pixel
+
+static void opComposeSprite(BenchContext &c) {
+    c.dmd->moveLayer(1, c.step % (c.width - 16), (c.step / 3) % (c.height - 15));
+    c.dmd->compose();
+}
+
+static void opScanFrame(BenchContext &c) {
+    for (int i = 0; i < 4; i++) c.dmd->scanDisplayBySPI();
+}
+
+static void opDrawAndScanFrame(BenchContext &c) {
+    c.dmd->drawChar(c.step % c.width, 0, '0' + c.step % 10, GRAPHICS_NORMAL);
+    for (int i = 0; i < 4; i++) c.dmd->scanDisplayBySPI();
+}
+
+// Compile-time geometry (DMDFixed), the same pixel pattern as opWritePixel
+template <uint16_t W, uint16_t H, uint8_t L>
+static void opWritePixelFixed(BenchContext &c) {
+    static_cast<DMDFixed<W, H, L>*>(c.dmd)->writePixel((c.step * 7) % c.width, (c.step * 3) % c.height,
+                                                        GRAPHICS_TOGGLE, true);
+}
+
+template <uint16_t W, uint16_t H, uint8_t L>
+static void benchFixed() {
+    static DMDMockBackend mock(false);
+    static DMDFixed<W, H, L> dmd(&mock);
+    char config[16];
+    snprintf(config, sizeof(config), "%dx%d", W, H);
+    BenchContext ctx;
+    ctx.dmd = &dmd;
+    ctx.width = DMDFixed<W, H, L>::Width;
+    ctx.height = DMDFixed<W, H, L>::Height;
+    ctx.step = 0;
+    run(config, L == DMD_LAYOUT_WIRE ? "wire" : "rows", "DMDFixed writePixel", ctx, opWritePixelFixed<W, H, L>, 1);
+}
+
+/*--------------------------------------------------------------------------------------
+ Main
+--------------------------------------------------------------------------------------*/
+struct FontEntry {
+    const char *name;
+    const uint8_t *font;
+};
+
+static const FontEntry fonts[] = {
+    { "System5x7", System5x7 },
+    { "Arial_14", Arial_14 },
+    { "Arial_Black_16", Arial_Black_16 },
+    { "Arial_Black_16_ISO_8859_1", Arial_Black_16_ISO_8859_1 },
+};
+
+static int stringPixels(DMD &dmd, const uint8_t *font) {
+    dmd.selectFont(font);
+    int width = 0;
+    for (size_t i = 0; i < sizeof(benchText) - 1; i++) width += dmd.charWidth(benchText[i]) + 1;
+    return width * font[FONT_HEIGHT];
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) minRunNs = strtoull(argv[1], NULL, 10) * 1000000ULL;
+
+    static const int walls[][2] = { {1, 1}, {2, 1}, {4, 2}, {8, 4}, {16, 8} };
+    static const uint8_t layouts[] = { DMD_LAYOUT_ROWS, DMD_LAYOUT_WIRE };
+    static const int marqueeSteps[][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-3, 0}, {2, 1} };
+
+    printf("%-6s %-5s %-34s %12s %12s\n", "wall", "lay", "benchmark", "ns/op", "Mpixels/s");
+    for (size_t w = 0; w < sizeof(walls) / sizeof(walls[0]); w++) {
+        for (size_t l = 0; l < sizeof(layouts); l++) {
+            char config[16];
+            snprintf(config, sizeof(config), "%dx%d", walls[w][0], walls[w][1]);
+            const char *layout = layouts[l] == DMD_LAYOUT_WIRE ? "wire" : "rows";
+
+            DMDMockBackend mock(false);
+            DMD dmd(walls[w][0], walls[w][1], layouts[l], &mock);
+            BenchContext ctx;
+            ctx.dmd = &dmd;
+            ctx.width = DMD_PIXELS_ACROSS * walls[w][0];
+            ctx.height = DMD_PIXELS_DOWN * walls[w][1];
+            ctx.step = 0;
+            double wallPixels = (double)ctx.width * ctx.height;
+            dmd.selectFont(System5x7);
+
+            run(config, layout, "writePixel", ctx, opWritePixel, 1);
+            for (int i = 0; i < BENCH_POINTS; i++) {
+                pointsX[i] = (i * 7) % ctx.width;
+                pointsY[i] = (i * 3) % ctx.height;
+            }
+            run(config, layout, "writePixels x256", ctx, opWritePixels, BENCH_POINTS);
+            for (size_t i = 0; i < sizeof(benchBitmap); i++) benchBitmap[i] = (uint8_t)(i * 37 + 11);
+            run(config, layout, "blit 32x16 unaligned", ctx, opBlitIcon, 32 * 16);
+            run(config, layout, "blit wall-wide x16", ctx, opBlitWide, (ctx.width < 500 ? ctx.width : 500) * 16);
+            run(config, layout, "drawLine diagonal", ctx, opDrawLine, ctx.width);
+            run(config, layout, "drawLine horizontal", ctx, opDrawHorizontalLine, ctx.width);
+            run(config, layout, "drawCircle", ctx, opDrawCircle, 6.28 * (ctx.height / 2 - 1));
+            run(config, layout, "drawFilledBox full wall", ctx, opDrawFilledBox, wallPixels);
+            for (size_t f = 0; f < sizeof(fonts) / sizeof(fonts[0]); f++) {
+                char name[48];
+                snprintf(name, sizeof(name), "drawString %s", fonts[f].name);
+                int pixels = stringPixels(dmd, fonts[f].font);
+                run(config, layout, name, ctx, opDrawString, pixels);
+            }
+            run(config, layout, "stringWidth (25 chars)", ctx, opStringWidth, sizeof(benchText) - 1);
+            dmd.selectFont(System5x7);
+            run(config, layout, "layoutText wrapped, centred", ctx, opLayoutText, stringPixels(dmd, System5x7));
+            run(config, layout, "drawText cached layout", ctx, opDrawTextCached, stringPixels(dmd, System5x7));
+            dmd.selectFont(System5x7);
+            for (size_t s = 0; s < sizeof(marqueeSteps) / sizeof(marqueeSteps[0]); s++) {
+                char name[48];
+                marqueeX = marqueeSteps[s][0];
+                marqueeY = marqueeSteps[s][1];
+                snprintf(name, sizeof(name), "stepMarquee %+d,%+d", marqueeX, marqueeY);
+                dmd.clearScreen(true);
+                dmd.drawMarquee(benchText, sizeof(benchText) - 1, 0, 0);
+                run(config, layout, name, ctx, opStepMarquee, wallPixels);
+            }
+            // Clock area on the left, two tickers at different speeds on the right
+            dmd.clearScreen(true);
+            int tickerX = ctx.width / 4, tickerHeight = ctx.height / 2;
+            dmd.setMarquee(0, benchText, sizeof(benchText) - 1, 0, 0, tickerX, 0, ctx.width - tickerX, tickerHeight,
+                           -DMD_MARQUEE_SUBSTEPS, 0, 8);
+            dmd.setMarquee(1, benchText, sizeof(benchText) - 1, 0, 0, tickerX, tickerHeight, ctx.width - tickerX,
+                           ctx.height - tickerHeight, -DMD_MARQUEE_SUBSTEPS * 3 / 2, 0, 8);
+            run(config, layout, "stepMarquees 2 tickers", ctx, opStepMarquees, (ctx.width - tickerX) * ctx.height);
+            dmd.removeMarquee(0);
+            dmd.removeMarquee(1);
+            static const uint8_t sprite[32] = {
+                0x07, 0xE0, 0x18, 0x18, 0x20, 0x04, 0x40, 0x02, 0x4C, 0x32, 0x8C, 0x31, 0x80, 0x01, 0x80, 0x01,
+                0x80, 0x01, 0x88, 0x11, 0x84, 0x21, 0x43, 0xC2, 0x40, 0x02, 0x20, 0x04, 0x18, 0x18, 0x07, 0xE0,
+            };
+            dmd.setLayer(0, ctx.width, ctx.height, GRAPHICS_NORMAL, 0);
+            for (size_t i = 0; i < sizeof(benchBackground); i++) benchBackground[i] = (uint8_t)(i * 53 + 7);
+            dmd.layerBlit(0, 0, 0, benchBackground, ctx.width / 8, ctx.width, ctx.height, GRAPHICS_NORMAL);
+            dmd.setLayer(1, 16, 16, GRAPHICS_TOGGLE, 1);
+            dmd.layerBlit(1, 0, 0, sprite, 2, 16, 16, GRAPHICS_NORMAL);
+            dmd.compose();
+            run(config, layout, "compose moving 16x16 sprite", ctx, opComposeSprite, 2 * 16 * 16);
+            dmd.removeLayer(0);
+            dmd.removeLayer(1);
+            dmd.compose();
+            run(config, layout, "clearScreen", ctx, opClearScreen, wallPixels);
+            run(config, layout, "scan frame (static)", ctx, opScanFrame, wallPixels);
+            run(config, layout, "drawChar + scan frame", ctx, opDrawAndScanFrame, wallPixels);
+        }
+    }
+
+    benchFixed<1, 1, DMD_LAYOUT_ROWS>();
+    benchFixed<1, 1, DMD_LAYOUT_WIRE>();
+    benchFixed<4, 2, DMD_LAYOUT_ROWS>();
+    benchFixed<4, 2, DMD_LAYOUT_WIRE>();
+    benchFixed<16, 8, DMD_LAYOUT_ROWS>();
+    benchFixed<16, 8, DMD_LAYOUT_WIRE>();
+    return 0;
+}